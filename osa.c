@@ -5,9 +5,201 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef TRACE
+#include <fcntl.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+//==============================================================================
+// Target
+//==============================================================================
+
+#define WORD_MAX 0xFFFF // largest value held by a 16-bit target word
+
+//==============================================================================
+// Source input
+//==============================================================================
+
+// Size of window streamed source text is read through
+
+#ifndef STREAM_WINDOW_SIZE
+#define STREAM_WINDOW_SIZE (1 << 20)
+#endif
+
+// Newline index. Tokens carry only byte offsets; lines and columns are
+// worked out from this index when a diagnostic needs them. The index is
+// built on demand and only as far into the source text as was asked for.
+
+struct line_index {
+    size_t *eols;      // offsets of newlines found so far, in order
+    size_t count;      // number of newlines in eols
+    size_t size;       // number of newlines eols can hold
+    size_t start;      // offset of source text where eols begins
+    size_t scanned;    // offset of source text up to which eols is complete
+    size_t line;       // number of newlines before start
+    size_t line_start; // offset of first character of line holding start
+};
+
+// Instruction set. Each entry gives the mnemonic followed by its first,
+// second and last characters, which key the keyword hash, and its operand
+// format. An instruction's opcode is its place in the list. The opcode
+// enum, the keyword table, and the format table shared by the encoder and
+// the decoder are all generated from this list, so they cannot disagree.
+
+#define MNEMONICS(X) \
+    X(nop,  'n', 'o', 'p', none) \
+    X(halt, 'h', 'a', 't', none) \
+    X(mov,  'm', 'o', 'v', rr)   \
+    X(ldi,  'l', 'd', 'i', ri)   \
+    X(ld,   'l', 'd', 'd', rr)   \
+    X(st,   's', 't', 't', rr)   \
+    X(add,  'a', 'd', 'd', rrr)  \
+    X(sub,  's', 'u', 'b', rrr)  \
+    X(and,  'a', 'n', 'd', rrr)  \
+    X(or,   'o', 'r', 'r', rrr)  \
+    X(xor,  'x', 'o', 'r', rrr)  \
+    X(not,  'n', 'o', 't', rr)   \
+    X(shl,  's', 'h', 'l', rrr)  \
+    X(shr,  's', 'h', 'r', rrr)  \
+    X(push, 'p', 'u', 'h', r)    \
+    X(pop,  'p', 'o', 'p', r)    \
+    X(jmp,  'j', 'm', 'p', a)    \
+    X(jz,   'j', 'z', 'z', ra)   \
+    X(jnz,  'j', 'n', 'z', ra)   \
+    X(call, 'c', 'a', 'l', a)    \
+    X(ret,  'r', 'e', 't', none) \
+    X(jr,   'j', 'r', 'r', r)
+
+// Registers, keyed like mnemonics and followed by the register number.
+// The stack pointer is another name for r7.
+
+#define REGISTERS(X) \
+    X(r0, 'r', '0', '0', 0)    \
+    X(r1, 'r', '1', '1', 1)    \
+    X(r2, 'r', '2', '2', 2)    \
+    X(r3, 'r', '3', '3', 3)    \
+    X(r4, 'r', '4', '4', 4)    \
+    X(r5, 'r', '5', '5', 5)    \
+    X(r6, 'r', '6', '6', 6)    \
+    X(r7, 'r', '7', '7', 7)    \
+    X(sp, 's', 'p', 'p', 7)
+
+// Assembler directives, keyed like mnemonics
+
+#define DIRECTIVES(X) \
+    X(org, 'o', 'r', 'g') \
+    X(dw,  'd', 'w', 'w') \
+    X(ds,  'd', 's', 's') \
+    X(equ, 'e', 'q', 'u')
+
+// Mnemonic
+
+#define X(name, c0, c1, cl, format) m_##name,
+typedef enum mnemonic {
+    MNEMONICS(X)
+    m_count
+} mnemonic;
+#undef X
+
+// Directive
+
+#define X(name, c0, c1, cl) d_##name,
+typedef enum directive {
+    DIRECTIVES(X)
+    d_count
+} directive;
+#undef X
+
+// Instruction words. The opcode takes the top five bits and register
+// fields follow it; fields the format does not use are zero. An instruction
+// with an immediate or an address takes a second word holding it.
+//
+//     15     11 10  8 7   5 4   2 1  0
+//     +--------+-----+-----+-----+----+
+//     | opcode | ra  | rb  | rc  | 00 |
+//     +--------+-----+-----+-----+----+
+
+#define MEMORY_WORDS (WORD_MAX + 1)              // words of target memory
+#define OPCODE_SHIFT 11                          // position of opcode
+#define REGISTER_MASK 7                          // mask of register field
+#define REGISTER_SHIFT(i) (8 - 3 * (i))          // position of ith register field
+#define REGISTER_FIELDS 3                        // most register fields in a word
+
+// Operand formats. Each entry gives the operands in order, r for a register
+// and v for a value (integer or label), the number of register fields, and
+// whether a second word holds the value.
+
+#define FORMATS(X) \
+    X(none, "",    0, false) \
+    X(r,    "r",   1, false) \
+    X(rr,   "rr",  2, false) \
+    X(rrr,  "rrr", 3, false) \
+    X(ri,   "rv",  1, true)  \
+    X(a,    "v",   0, true)  \
+    X(ra,   "rv",  1, true)
+
+// Operand format
+
+#define X(name, operands, registers, word) f_##name,
+typedef enum operand_format {
+    FORMATS(X)
+    f_count
+} operand_format;
+#undef X
+
+// Operand format description
+
+struct format {
+    const char *operands; // operand kinds in order
+    uint8_t registers;    // number of register fields
+    bool word;            // value follows in second word
+};
+
+// Decoded instruction
+
+struct instruction {
+    uint8_t mnemonic;                   // mnemonic, which is the opcode
+    uint8_t format;                     // operand format
+    uint8_t registers[REGISTER_FIELDS]; // register numbers
+};
+
+//==============================================================================
+// Keywords
+//==============================================================================
+
+// Kind of keyword
+
+typedef enum keyword_kind {
+    kk_none,
+    kk_mnemonic,
+    kk_register,
+    kk_directive
+} keyword_kind;
+
+// Keyword
+
+struct keyword {
+    const char *name; // spelling of keyword in lowercase
+    uint8_t length;   // length of keyword
+    uint8_t kind;     // kind of keyword
+    uint8_t code;     // mnemonic, register number or directive
+};
 
 //==============================================================================
 // Token
@@ -19,6 +211,19 @@ typedef enum token_type {
     t_id,
     t_int,
     t_colon,
+    t_plus,
+    t_minus,
+    t_star,
+    t_slash,
+    t_percent,
+    t_shl,
+    t_shr,
+    t_amp,
+    t_pipe,
+    t_caret,
+    t_tilde,
+    t_lparen,
+    t_rparen,
     t_squote,
     t_dquote,
     t_eol,
@@ -29,15 +234,431 @@ typedef enum token_type {
 // Token
 
 struct token {
-    char lexeme[256]; // string treated like stack stores lexeme captured from source
-    int top;          // used by stack operations to point to top of lexeme
-    bool eol;         // special flag used to indicate EOL
-    bool eof;         // also a special flag for EOF
     token_type type;  // used to indicate token type
     int intval;       // stores evaluated integer value
-    char *strval;     // ...
+    size_t offset;    // offset of lexeme in source text
+    size_t length;    // length of lexeme
+    uint32_t hash;    // hash of identifier
+    int id;           // ID of interned identifier, or 0
+};
+
+// Token block, filled by lex_batch() in structure-of-arrays layout. Values
+// are 32-bit: integers fit in 16 bits, but identifier IDs need more.
+
+#define TOKEN_BLOCK_SIZE 512 // most tokens filled by one call
+
+struct token_block {
+    size_t count;                        // number of tokens in block
+    uint8_t types[TOKEN_BLOCK_SIZE];     // token types
+    uint32_t offsets[TOKEN_BLOCK_SIZE];  // offsets of lexemes in source text
+    uint32_t lengths[TOKEN_BLOCK_SIZE];  // lengths of lexemes
+    uint32_t values[TOKEN_BLOCK_SIZE];   // integer values or identifier IDs
+};
+
+// Token list
+
+struct token_list {
+    struct token *tokens; // tokens in source order
+    size_t count;         // number of tokens in list
+    size_t size;          // number of tokens list can hold
+};
+
+//==============================================================================
+// Character classes
+//==============================================================================
+
+// Input classes seen by the tokenizer
+
+typedef enum input_class {
+    ic_other,       // anything that can be part of a lexeme
+    ic_whitespace,  // whitespace
+    ic_symbol,      // symbol
+    ic_eol,         // end-of-line
+    ic_eof,         // end-of-file
+    ic_sqmark,      // single quotation mark
+    ic_dqmark,      // double quotation mark
+    ic_comment      // comment initiator
+} input_class;
+
+// Character flags seen by the recognizers
+
+enum {
+    cf_bindigit   = 0x01,
+    cf_octdigit   = 0x02,
+    cf_decdigit   = 0x04,
+    cf_hexdigit   = 0x08,
+    cf_letter     = 0x10,
+    cf_underscore = 0x20,
+    cf_visible    = 0x40
+};
+
+//==============================================================================
+// Arena
+//==============================================================================
+
+// Arena block
+
+struct arena_block {
+    struct arena_block *next; // previously filled block
+    size_t size;              // capacity of block in bytes
+    size_t used;              // bytes handed out from block
+    max_align_t data[];       // storage handed out by the arena
+};
+
+// Arena
+
+struct arena {
+    struct arena_block *head; // block currently being allocated from
+};
+
+//==============================================================================
+// Identifier table
+//==============================================================================
+
+// Interned identifier
+
+struct name {
+    const char *text; // text of identifier
+    size_t length;    // length of identifier
+    uint32_t hash;    // hash of identifier
+    const struct keyword *keyword; // keyword spelled by identifier, or NULL
+};
+
+// Identifier table. Every distinct identifier gets a small integer ID, so
+// later stages compare IDs instead of strings.
+
+struct name_table {
+    uint32_t *slots;    // IDs of names placed by hash; 0 marks an empty slot
+    size_t size;        // number of slots, a power of two
+    struct name *names; // names by ID; ID 0 is never handed out
+    size_t count;       // number of IDs handed out, counting ID 0
+    size_t capacity;    // number of names the names array can hold
+    struct arena arena; // storage for text of names
+};
+
+//==============================================================================
+// Lexer
+//==============================================================================
+
+// Diagnostic held back, to be reported in source order
+
+struct diagnostic {
+    size_t offset; // offset in source text it refers to
+    char *text;    // message, with line and column
+};
+
+// Diagnostics held back, in source order
+
+struct diagnostic_list {
+    struct diagnostic *items; // diagnostics
+    size_t count;             // number of diagnostics
+    size_t size;              // number of diagnostics items can hold
+    size_t next;              // index of first one not yet reported
+};
+
+// Lexer context. Everything the lexer needs to tokenize one source lives
+// here, so any number of sources can be lexed at once, one lexer per thread.
+
+struct lexer {
+    const char *buf;                 // source text
+    const char *pos;                 // position of next character in source text
+    const char *end;                 // end of source text
+    bool mapped;                     // source text is memory-mapped
+    bool owned;                      // source text is released with the lexer
+    int fd;                          // descriptor source text is streamed from, or -1
+    char *window;                    // buffer holding streamed source text, or NULL
+    size_t size;                     // capacity of window
+    size_t base;                     // offset of first character of buf in source text
+    const char *mark;                // start of lexeme being captured, or NULL
+    size_t hold;                     // offset of oldest text still to be located,
+                                     // or SIZE_MAX
+    struct line_index lines;         // newlines found in source text
+    int input;                       // stores character retrieved from source text
+    struct arena arena;              // storage for tokens and lexer strings
+    struct name_table names;         // identifiers found in source text
+    bool intern;                     // identifiers are interned as they are found
+    bool defer;                      // errors are held in deferred, not reported
+    struct diagnostic_list deferred; // errors held back
+    int errors;                      // number of errors reported
+};
+
+// Shard of source text lexed by one thread
+
+struct shard {
+    const char *buf;                    // source text shard is part of
+    size_t start;                       // offset of shard in source text
+    size_t len;                         // length of shard
+    struct token_list tokens;           // tokens found in shard
+    struct diagnostic_list diagnostics; // errors found in shard
+    int errors;                         // number of errors reported
+};
+
+// Tokens the parser can see ahead of the current one, counting it
+
+#define LOOKAHEAD_SIZE 4 // a power of two
+
+// Lookahead. A ring of tokens scanned ahead of the parser, so it can peek
+// at upcoming tokens without allocating any.
+
+struct lookahead {
+    struct lexer *lx;                     // lexer tokens are scanned from
+    const struct token_list *list;        // tokens already lexed, or NULL to scan
+    struct token tokens[LOOKAHEAD_SIZE];  // tokens, by sequence number modulo size
+    size_t head;                          // sequence number of current token
+    size_t tail;                          // sequence number of next token to scan
+};
+
+//==============================================================================
+// Tree
+//==============================================================================
+
+// Node kind
+
+typedef enum node_kind {
+    n_none,        // index 0, standing for no node
+    n_statement,   // line of source; children are label and operation
+    n_label,       // label defined by line; value is identifier ID
+    n_instruction, // instruction; code is mnemonic, value is identifier ID,
+                   // children are operands
+    n_directive,   // directive; code is directive, value is identifier ID,
+                   // children are operands
+    n_register,    // register operand; code is register number
+    n_integer,     // integer operand; value is integer
+    n_symbol,      // identifier operand; value is identifier ID
+    n_string,      // string operand; value is offset of its text in tree
+    n_expression   // expression operand needing labels; value is index of
+                   // its postfix program in tree, length its number of
+                   // operations
+} node_kind;
+
+// Node. Nodes are fixed-size records kept in one array and linked by index,
+// so a tree is a few large allocations and is walked front to back.
+
+struct node {
+    uint8_t kind;    // node kind
+    uint8_t code;    // mnemonic, directive or register number
+    uint16_t count;  // number of children
+    uint32_t child;  // index of first child, or 0
+    uint32_t next;   // index of next sibling, or 0
+    uint32_t offset; // offset of lexeme in source text
+    uint32_t length; // length of lexeme, or of string text
+    int32_t value;   // integer value, identifier ID or text offset
+};
+
+// Tree
+
+struct tree {
+    struct node *nodes;      // nodes by index; node 0 is never used
+    uint32_t count;          // number of nodes, counting node 0
+    uint32_t size;           // number of nodes the array can hold
+    uint32_t first;          // index of first statement, or 0
+    uint32_t last;           // index of last statement, or 0
+    char *text;              // text of string operands, without quotation marks
+    size_t length;           // number of characters in text
+    size_t capacity;         // number of characters text can hold
+    struct operation *code;  // postfix programs of expression operands
+    uint32_t code_length;    // number of operations in code
+    uint32_t code_size;      // number of operations code can hold
+};
+
+// Expressions. Operators are those of C, with the same precedence; values
+// are target words and all arithmetic wraps around at 16 bits. Constant
+// parts are folded while the expression is parsed. What is left depends on
+// labels and is kept as a short postfix program for the assembler, which
+// runs it once the labels are known.
+
+#define EXPRESSION_DEPTH 32  // deepest nesting of parentheses and unary operators
+#define EXPRESSION_STACK 256 // values a postfix program can have on its stack
+
+// Operator of postfix program
+
+typedef enum operator {
+    o_const, // push constant
+    o_label, // push value of label
+    o_neg,   // negate
+    o_not,   // complement
+    o_mul,
+    o_div,
+    o_mod,
+    o_add,
+    o_sub,
+    o_shl,
+    o_shr,
+    o_and,
+    o_xor,
+    o_or
+} operator;
+
+// Operation of postfix program
+
+struct operation {
+    uint32_t op;    // operator
+    uint32_t value; // constant, or identifier ID of label
+};
+
+//==============================================================================
+// Assembler
+//==============================================================================
+
+// Symbol. What the assembler knows of an identifier used as a label, kept
+// inline in its slot of the symbol table.
+
+struct symbol {
+    uint32_t id;     // identifier ID of label, or 0 for an empty slot
+    uint32_t hash;   // hash of identifier
+    uint32_t fixups; // index of first word waiting for label, or 0
+    uint16_t value;  // value of label once defined
+    bool defined;    // label has been defined
+};
+
+// Symbol table. Only identifiers used as labels get a slot, so the table
+// stays small next to the identifier table however many mnemonics and
+// registers the source text spells.
+
+struct symbol_table {
+    struct symbol *slots; // symbols placed by hash
+    size_t size;          // number of slots, a power of two
+    size_t count;         // number of symbols
+};
+
+// Fixup. A word that refers to a label not yet defined; it is patched when
+// the label is.
+
+struct fixup {
+    uint32_t next;    // index of next fixup waiting for same label, or 0
+    uint32_t address; // address of word to patch
+    uint32_t offset;  // offset of reference in source text
+    uint32_t line;    // line of reference, or 0 if not known
+    uint32_t column;  // column of reference
+    uint32_t code;    // index of postfix program in tree
+    uint32_t length;  // number of operations in program, or 0 for label alone
+};
+
+// First use of an undefined label, for reporting it at the end
+
+struct label_use {
+    uint32_t fixup;   // index of fixup of use, or 0 if not used
+    uint32_t op;      // index of operation of use in tree
+    uint32_t offset;  // offset of use in source text
+    int id;           // ID of label
+};
+
+// Assembler. Statements are encoded as soon as they are parsed, so the
+// source text is gone through once.
+
+struct assembler {
+    struct lexer *lx;       // lexer, for identifier names and errors
+    struct tree *tree;      // tree statements are taken from
+    uint16_t *image;        // memory image being assembled
+    uint32_t loc;           // address of next word
+    uint32_t top;           // address after highest word placed
+    bool full;              // program has run past the end of memory
+    struct symbol_table symbols; // labels defined or used so far
+    struct fixup *fixups;   // fixups by index; fixup 0 is never used
+    uint32_t nfixups;       // number of fixups, counting fixup 0
+    uint32_t fixup_size;    // number of fixups the array can hold
+};
+
+//==============================================================================
+// Instrumentation
+//==============================================================================
+
+// Build with -DINSTRUMENT to have the lexer count what it does and dump the
+// counts as JSON on standard error at exit. Without it COUNT() expands to
+// nothing and the lexer is exactly as fast as ever.
+
+#ifdef INSTRUMENT
+
+#define LEXER_STATES 11 // number of tokenizer states, S0 to S8
+
+// Recognizers whose calls are counted
+
+typedef enum recognizer_call {
+    rc_classify,
+    rc_id,
+    rc_int,
+    rc_bin,
+    rc_oct,
+    rc_dec,
+    rc_hex,
+    rc_sqstr,
+    rc_dqstr,
+    rc_count
+} recognizer_call;
+
+// Lexer counts
+
+struct lexer_counts {
+    unsigned long transitions[LEXER_STATES][LEXER_STATES]; // by state left and state entered
+    unsigned long tokens[t_unknown + 1]; // tokens by type
+    unsigned long source_bytes;          // bytes consumed, counting blanks and comments
+    unsigned long lexeme_bytes;          // bytes in lexemes
+    unsigned long comment_bytes;         // bytes skipped in comments (state 7)
+    unsigned long sqstring_bytes;        // bytes inside single-quote strings (state 5.1)
+    unsigned long dqstring_bytes;        // bytes inside double-quote strings (state 6.1)
+    unsigned long calls[rc_count];       // calls by recognizer
+};
+
+#define COUNT(counter, n) (lexer_counts.counter += (n))
+
+#else
+
+#define COUNT(counter, n) ((void)0)
+
+#endif
+
+//==============================================================================
+// Tracing
+//==============================================================================
+
+// Build with -DTRACE to have the lexer record what it does in a binary trace
+// file, named by the OSA_TRACE environment variable or osa.trace by default.
+// Every event goes through TRACE_EVENT(), which compiles to nothing otherwise.
+// Records are fixed-size and in host byte order, so the file is an array of
+// struct trace_record.
+
+#ifdef TRACE
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 4096 // records buffered per thread, a power of two
+#endif
+
+// Trace event
+
+typedef enum trace_event {
+    te_token,  // token scanned: type, offset, length and value
+    te_refill, // streamed text read: offset and length of text read
+    te_error   // error reported: offset of error
+} trace_event;
+
+// Trace record
+
+struct trace_record {
+    uint16_t event;   // trace event
+    uint16_t thread;  // number of thread recording event, from 1
+    uint32_t length;  // length of lexeme or text
+    uint64_t offset;  // offset in source text
+    int32_t value;    // integer value or identifier ID
+    uint32_t type;    // token type
 };
 
+// Ring of trace records waiting to be written
+
+struct trace_ring {
+    struct trace_record records[TRACE_RING_SIZE]; // records, by sequence number modulo size
+    size_t head;   // sequence number of next record to add
+    size_t tail;   // sequence number of oldest record not yet written
+    int thread;    // number of thread owning ring, or 0 until first record
+};
+
+#define TRACE_EVENT(event, type, offset, length, value) trace(event,type,offset,length,value)
+
+#else
+
+#define TRACE_EVENT(event, type, offset, length, value) ((void)0)
+
+#endif
+
 //==============================================================================
 // Prototypes
 //==============================================================================
@@ -51,42 +672,133 @@ void fail(const char *, ... );
 
 void display_usage(const char *);
 void init();
-char *get_meaning(token_type);
+void detect_cpu();
+bool assemble(struct lexer *, int, const char *);
+const char *get_meaning(token_type);
+
+// Lexer / Character classes
+
+input_class get_input_class(int);
+int get_char_flags(int);
+
+// Lexer / Context
+
+void init_lexer(struct lexer *);
+void open_lexer(struct lexer *, FILE *);
+void open_lexer_buffer(struct lexer *, const char *, size_t);
+void open_stream_lexer(struct lexer *, int, size_t);
+void close_lexer(struct lexer *);
+void lexer_error(struct lexer *, size_t, const char *, ... );
+
+// Lexer / Source input
+
+void load_source(struct lexer *, FILE *);
+void read_source(struct lexer *, FILE *);
+void unload_source(struct lexer *);
+bool refill_source(struct lexer *);
+
+// Lexer / Source positions
+
+void init_lines(struct line_index *);
+void release_lines(struct line_index *);
+void grow_lines(struct line_index *);
+void index_lines(struct lexer *, size_t);
+void drop_lines(struct lexer *, size_t);
+bool locate_offset(struct lexer *, size_t, size_t *, size_t *);
 
 // Lexer
 
-int get_next_char();
-struct token *get_next_token();
+int get_next_char(struct lexer *);
+void skip_whitespace(struct lexer *);
+void skip_to_eol(struct lexer *);
+size_t get_input_offset(struct lexer *);
+struct token *get_next_token(struct lexer *);
+size_t lex_batch(struct lexer *, struct token_block *);
+void scan_token(struct lexer *, struct token *);
+
+// Lexer / Parallel lexing
+
+void lex_parallel(struct lexer *, int, struct token_list *);
+void *lex_shard(void *);
+size_t split_source(const char *, size_t, size_t);
+void append_token(struct token_list *, const struct token *);
+void release_token_list(struct token_list *);
+void init_diagnostics(struct diagnostic_list *);
+void release_diagnostics(struct diagnostic_list *);
+void add_diagnostic(struct diagnostic_list *, size_t, const char *);
+void report_deferred(struct lexer *, size_t);
+
+// Lexer / Lookahead
+
+void init_lookahead(struct lookahead *, struct lexer *);
+void init_lookahead_list(struct lookahead *, struct lexer *, const struct token_list *);
+const struct token *peek_token(struct lookahead *, size_t);
+void advance_token(struct lookahead *);
 
 // Lexer / Operations for token data structure
 
-struct token *create_token();
-void push_to_lexeme(struct token *, int);
-int pop_from_lexeme(struct token *);
-void flush_lexeme(struct token *);
+struct token *create_token(struct lexer *);
+void init_token(struct token *);
+void capture_lexeme(struct lexer *, struct token *);
+char *get_lexeme(struct lexer *, const struct token *);
+char *get_strval(struct lexer *, const struct token *);
+
+// Lexer / Scanners
+
+const char *find_eol_scalar(const char *, const char *);
+const char *skip_blanks_scalar(const char *, const char *);
+void scan_newlines_scalar(struct line_index *, const char *, const char *, size_t);
+#ifdef HAVE_X86_SIMD
+const char *find_eol_sse2(const char *, const char *);
+const char *find_eol_avx2(const char *, const char *);
+const char *skip_blanks_sse2(const char *, const char *);
+const char *skip_blanks_avx2(const char *, const char *);
+void scan_newlines_sse2(struct line_index *, const char *, const char *, size_t);
+void scan_newlines_avx2(struct line_index *, const char *, const char *, size_t);
+#endif
+
+// Lexer / Classifier
+
+token_type classify_lexeme(const char *, size_t, int *);
+
+// Lexer / Digit parsers
+
+size_t parse_digits_scalar(const char *, size_t, int, unsigned int *);
+size_t parse_digits_swar(const char *, size_t, int, unsigned int *);
+static inline uint64_t swar_in_range(uint64_t, int, int);
+static inline uint64_t swar_digits(uint64_t, int);
+static inline uint32_t swar_convert(uint64_t, int);
+static inline void add_digit_block(unsigned int *, uint32_t, int);
+#ifdef HAVE_X86_SIMD
+static inline int sse2_digits(__m128i, int);
+static inline uint32_t sse2_convert_bin(__m128i);
+static inline void add_bin_block(unsigned int *, uint32_t);
+size_t parse_digits_sse2(const char *, size_t, int, unsigned int *);
+size_t parse_digits_ssse3(const char *, size_t, int, unsigned int *);
+#endif
 
 // Lexer / Evaluators
 
-int eval_bin(const char *);
-int eval_oct(const char *);
-int eval_dec(const char *);
-int eval_hex(const char *);
-int eval(const char *, int);
+int eval_bin(const char *, size_t);
+int eval_oct(const char *, size_t);
+int eval_dec(const char *, size_t);
+int eval_hex(const char *, size_t);
+int eval(const char *, size_t, int);
 int get_value(int);
-char *eval_sqstr(char *);
-char *eval_dqstr(char *);
+char *eval_sqstr(struct arena *, const char *, size_t);
+char *eval_dqstr(struct arena *, const char *, size_t);
 
 // Lexer / Recognizers 
 
-bool is_terminal(const char *, const char *);
-bool is_id(const char *);
-bool is_int(const char *);
-bool is_bin(const char *);
-bool is_oct(const char *);
-bool is_dec(const char *);
-bool is_hex(const char *);
-bool is_sqstr(const char *);
-bool is_dqstr(const char *);
+bool is_terminal(const char *, const char *, size_t);
+bool is_id(const char *, size_t);
+bool is_int(const char *, size_t);
+bool is_bin(const char *, size_t);
+bool is_oct(const char *, size_t);
+bool is_dec(const char *, size_t);
+bool is_hex(const char *, size_t);
+bool is_sqstr(const char *, size_t);
+bool is_dqstr(const char *, size_t);
 
 // Lexer / Atom recognizers
 
@@ -120,18 +832,177 @@ int touppercase(int);
 int tolowercase(int);
 char *substr(const char *, size_t);
 char *dupstr(const char *);
+int char_at(const char *, size_t, size_t);
+
+// Tree builder
+
+void init_tree(struct tree *);
+void release_tree(struct tree *);
+uint32_t add_node(struct tree *, node_kind, const struct token *);
+void add_child(struct tree *, uint32_t, uint32_t);
+uint32_t add_text(struct tree *, const char *, size_t);
+void build_tree(struct tree *, struct lookahead *);
+void add_statement(struct tree *, uint32_t);
+uint32_t parse_statement(struct tree *, struct lookahead *);
+uint32_t reject_statement(struct tree *, struct lookahead *, uint32_t, size_t, uint32_t);
+uint32_t parse_operand(struct tree *, struct lookahead *);
+uint32_t parse_value(struct tree *, struct lookahead *);
+bool parse_expression(struct tree *, struct lookahead *, int, int);
+bool parse_unary(struct tree *, struct lookahead *, int);
+void add_operation(struct tree *, operator, uint32_t);
+bool fold_operation(struct tree *, struct lexer *, operator, uint32_t, uint32_t, size_t);
+const struct keyword *get_keyword(struct lookahead *, const struct token *);
+void skip_line(struct lookahead *);
+
+// Instruction set
+
+uint16_t encode_word(mnemonic, const uint8_t *);
+bool decode_word(uint16_t, struct instruction *);
+
+// Disassembler
+
+void disassemble(const char *);
+
+// Code generation
+
+void init_assembler(struct assembler *, struct lexer *, struct tree *);
+void release_assembler(struct assembler *);
+void assemble_statement(struct assembler *, uint32_t);
+void encode_instruction(struct assembler *, uint32_t);
+void encode_directive(struct assembler *, uint32_t);
+bool match_operands(const struct node *, uint32_t, operand_format);
+struct symbol *get_symbol(struct assembler *, int);
+void define_label(struct assembler *, uint32_t, int);
+bool get_known_value(struct assembler *, uint32_t, int *);
+void emit_word(struct assembler *, int, uint32_t);
+void emit_operand(struct assembler *, uint32_t);
+void add_fixup(struct assembler *, struct symbol *, uint32_t, uint32_t, uint32_t);
+bool run_expression(struct assembler *, uint32_t, uint32_t, const struct fixup *, int *, struct symbol **);
+void fixup_error(struct assembler *, const struct fixup *, const char *, ...);
+bool apply_operator(operator, unsigned int, unsigned int, unsigned int *);
+void finish_assembly(struct assembler *);
+int compare_label_uses(const void *, const void *);
+void write_image(struct assembler *, const char *);
+
+// Symbol table
+
+void init_symbols(struct symbol_table *);
+void release_symbols(struct symbol_table *);
+struct symbol *find_symbol(struct symbol_table *, int, uint32_t);
+struct symbol *add_symbol(struct symbol_table *, int, uint32_t);
+void grow_symbols(struct symbol_table *);
+
+// Identifier table
+
+void init_names(struct name_table *);
+void release_names(struct name_table *);
+uint32_t hash_name(const char *, size_t);
+int intern_name(struct name_table *, const char *, size_t, uint32_t);
+void grow_names(struct name_table *);
+const char *get_name(const struct name_table *, int);
+
+// Keywords
+
+const struct keyword *find_keyword(const char *, size_t);
+
+// Arena
+
+void *arena_alloc(struct arena *, size_t);
+char *arena_substr(struct arena *, const char *, size_t);
+void arena_release(struct arena *);
 
 // Error-trapped functions
 
 FILE *efopen(const char *, const char *);
 void *emalloc(size_t);
+void *erealloc(void *, size_t);
+
+// Instrumentation
+
+#ifdef INSTRUMENT
+void merge_counts();
+void dump_counts();
+#endif
+
+// Tracing
+
+#ifdef TRACE
+void open_trace();
+void trace(trace_event, int, size_t, size_t, int);
+void flush_trace();
+#endif
+
+// Benchmarks
+
+#ifdef BENCHMARK
+int benchmark(int, char *[]);
+double get_time();
+size_t parse_digits_eval(const char *, size_t, int, unsigned int *);
+void bench_digits();
+void bench_lex(const char *);
+void bench_parallel(const char *);
+const struct keyword *find_keyword_chain(const char *);
+void bench_keywords();
+uint64_t get_cycles();
+size_t parse_size(const char *);
+int find_corpus_kind(const char *);
+uint32_t corpus_random(uint32_t);
+size_t corpus_word(char *);
+size_t corpus_identifier(char *);
+size_t corpus_number(char *);
+size_t corpus_text(char *, bool);
+size_t corpus_line(int, char *);
+char *generate_corpus(int, size_t, size_t *);
+void write_corpus(const char *, const char *, const char *);
+void bench_suite(const char *);
+size_t sample_lexeme(int, bool, bool, char *);
+double time_recognizer(int);
+token_type cascade_lexeme(const char *, size_t, int *);
+int compare_doubles(const void *, const void *);
+void bench_recognizers();
+void bench_tree(const char *);
+void bench_symbols();
+void check_positions(const char *);
+char *capture_errors(struct lexer *);
+#endif
 
 //==============================================================================
 // Assembler components
 //==============================================================================
 
-FILE *src; // source file
-int input; // stores character retrieved from source file
+// Scanners and digit parser best suited to the CPU, selected by detect_cpu()
+
+const char *(*find_eol)(const char *, const char *) = find_eol_scalar;
+const char *(*skip_blanks)(const char *, const char *) = skip_blanks_scalar;
+void (*scan_newlines)(struct line_index *, const char *, const char *, size_t) = scan_newlines_scalar;
+size_t (*parse_digits)(const char *, size_t, int, unsigned int *) = parse_digits_swar;
+
+// Allocation counts of the running thread, kept by benchmark builds only
+
+#ifdef BENCHMARK
+_Thread_local struct {
+    unsigned long heap;  // blocks from emalloc() and erealloc()
+    unsigned long arena; // allocations from arenas
+} alloc_counts;
+#endif
+
+// Lexer counts of the running thread, and of every thread once merged, kept
+// by instrumented builds only
+
+#ifdef INSTRUMENT
+_Thread_local struct lexer_counts lexer_counts;
+struct lexer_counts lexer_totals;
+pthread_mutex_t lexer_totals_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Trace records of the running thread, and the file they go to, kept by
+// tracing builds only
+
+#ifdef TRACE
+_Thread_local struct trace_ring trace_ring;
+int trace_fd = -1;
+int trace_threads;
+#endif
 
 //==============================================================================
 // Error output
@@ -141,23 +1012,24 @@ int input; // stores character retrieved from source file
 
 void error(const char *format, ... )
 {
-    printf("Error: ");
+    // Format the whole message first so that errors reported from several
+    // threads do not interleave.
+    char s[1024];
     va_list args;
     va_start(args,format);
-    vprintf(format,args);
+    vsnprintf(s,sizeof(s),format,args);
     va_end(args);
-    printf("\n");
+    printf("Error: %s\n",s);
 }
 
 // Report error and exit
 
 void fail(const char *format, ... )
 {
-    char *s;
-    s = emalloc(strlen(format)+1);
+    char s[1024];
     va_list args;
     va_start(args,format);
-    vsprintf(s,format,args);
+    vsnprintf(s,sizeof(s),format,args);
     va_end(args);
     error("%s",s);
     exit(EXIT_FAILURE);
@@ -169,13 +1041,60 @@ void fail(const char *format, ... )
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2) {
+#ifdef BENCHMARK
+    init();
+    return benchmark(argc,argv);
+#endif
+    struct lexer lexer;
+    FILE *src;
+    const char *output;
+    int threads;
+    int file;
+    bool listing;
+    bool ok;
+
+    threads = 1;
+    output = "a.bin";
+    listing = false;
+    for (file=1; file<argc-1; file++) {
+        if (strcmp(argv[file],"-j") == 0 && file + 2 < argc) {
+            threads = atoi(argv[++file]);
+        }
+        else if (strcmp(argv[file],"-o") == 0 && file + 2 < argc) {
+            output = argv[++file];
+        }
+        else if (strcmp(argv[file],"-d") == 0) {
+            listing = true;
+        }
+        else {
+            break;
+        }
+    }
+    if (file != argc - 1 || threads < 1) {
         display_usage(argv[0]);
         return 0;
     }
+    else if (listing) {
+        init();
+        disassemble(argv[file]);
+    }
     else {
-        src = efopen(argv[1],"rb");
         init();
+        if (strcmp(argv[file],"-") == 0) {
+            src = stdin;
+        }
+        else {
+            src = efopen(argv[file],"rb");
+        }
+        open_lexer(&lexer,src);
+        ok = assemble(&lexer,threads,output);
+        close_lexer(&lexer);
+        if (src != stdin) {
+            fclose(src);
+        }
+        if (!ok) {
+            return EXIT_FAILURE;
+        }
     }
     return 0;
 }
@@ -188,7 +1107,11 @@ int main(int argc, char *argv[])
 
 void display_usage(const char *self)
 {
-    printf("Usage: %s <file>\n", self);
+    printf("Usage: %s [-j threads] [-o output] <file>\n", self);
+    printf("       %s -d <image>\n", self);
+    printf("Use - as file to read from standard input.\n");
+    printf("The memory image is written to a.bin unless -o is given.\n");
+    printf("With -d, the memory image is disassembled instead.\n");
 }
 
 //=============================================================================
@@ -199,8 +1122,110 @@ void display_usage(const char *self)
 
 void init()
 {
-    // Get first character for the lexer to start with
-    input = get_next_char();
+    detect_cpu();
+#ifdef INSTRUMENT
+    atexit(dump_counts);
+#endif
+#ifdef TRACE
+    open_trace();
+#endif
+}
+
+// Select code paths for the CPU we are running on
+
+void detect_cpu()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    // The digit parser only needs 128-bit multiply-adds, so it is picked
+    // apart from the scanners
+    if (__builtin_cpu_supports("ssse3")) {
+        parse_digits = parse_digits_ssse3;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        parse_digits = parse_digits_sse2;
+    }
+    else {
+        parse_digits = parse_digits_swar;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        find_eol = find_eol_avx2;
+        skip_blanks = skip_blanks_avx2;
+        scan_newlines = scan_newlines_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        find_eol = find_eol_sse2;
+        skip_blanks = skip_blanks_sse2;
+        scan_newlines = scan_newlines_sse2;
+        return;
+    }
+#else
+    parse_digits = parse_digits_swar;
+#endif
+    find_eol = find_eol_scalar;
+    skip_blanks = skip_blanks_scalar;
+    scan_newlines = scan_newlines_scalar;
+}
+
+//=============================================================================
+// Assembler
+//=============================================================================
+
+// Assemble source
+
+bool assemble(struct lexer *lx, int threads, const char *output)
+{
+    // Each statement is encoded as soon as it is parsed. A reference to a
+    // label not yet defined leaves a fixup behind, which is patched when
+    // the label turns up, so the source text is lexed and parsed only once.
+    // The memory image is written only if no error was found.
+
+    struct lookahead la;      // tokens seen by tree builder
+    struct token_list tokens; // tokens lexed in parallel
+    struct tree tree;         // tree built from source
+    struct assembler as;      // assembler state
+    uint32_t statement;       // index of statement
+    bool ok;                  // assembly succeeded
+
+    tokens.tokens = NULL;
+    tokens.count = 0;
+    tokens.size = 0;
+
+    // Streamed source text is never all in memory at once, so it is
+    // always lexed on one thread. Errors in a statement may be reported
+    // after the lexer has read past it, so the lexer is told to keep its
+    // text locatable until the next statement starts.
+    lx->hold = 0;
+    if (threads > 1 && !lx->window) {
+        lex_parallel(lx,threads,&tokens);
+        init_lookahead_list(&la,lx,&tokens);
+    }
+    else {
+        init_lookahead(&la,lx);
+    }
+
+    init_tree(&tree);
+    init_assembler(&as,lx,&tree);
+    while (peek_token(&la,0)->type != t_eof) {
+        lx->hold = peek_token(&la,0)->offset;
+        statement = parse_statement(&tree,&la);
+        if (statement) {
+            add_statement(&tree,statement);
+            assemble_statement(&as,statement);
+        }
+    }
+    finish_assembly(&as);
+
+    ok = lx->errors == 0;
+    if (ok) {
+        write_image(&as,output);
+    }
+    release_assembler(&as);
+    release_tree(&tree);
+    release_token_list(&tokens);
+    return ok;
 }
 
 //=============================================================================
@@ -209,1399 +1234,5941 @@ void init()
 
 // Return English meaning of given token
 
-char *get_meaning(token_type type)
+const char *get_meaning(token_type type)
 {
-    char *s;
-    
     switch (type) {
         case t_id:
-            s = dupstr("identifier");
-            break;
+            return "identifier";
             
         case t_int:
-            s = dupstr("integer");
-            break;
+            return "integer";
             
         case t_colon:
-            s = dupstr("colon");
-            break;
+            return "colon";
+
+        case t_plus:
+            return "plus sign";
+
+        case t_minus:
+            return "minus sign";
+
+        case t_star:
+            return "asterisk";
+
+        case t_slash:
+            return "slash";
+
+        case t_percent:
+            return "percent sign";
+
+        case t_shl:
+            return "left shift";
+
+        case t_shr:
+            return "right shift";
+
+        case t_amp:
+            return "ampersand";
+
+        case t_pipe:
+            return "vertical bar";
+
+        case t_caret:
+            return "caret";
+
+        case t_tilde:
+            return "tilde";
+
+        case t_lparen:
+            return "left parenthesis";
+
+        case t_rparen:
+            return "right parenthesis";
             
         case t_squote:
-            s = dupstr("single quotation mark");
-            break;
+            return "single quotation mark";
             
         case t_dquote:
-            s = dupstr("double quotation mark");
-            break;
+            return "double quotation mark";
             
         case t_eol:
-            s = dupstr("end-of-line");
-            break;
+            return "end-of-line";
             
         case t_eof:
-            s = dupstr("end-of-input");
-            break;
+            return "end-of-input";
             
         case t_unknown:
-            s = dupstr("unknown");
-            break;
+        default:
+            return "unknown";
     }
 }
 
 //=============================================================================
-// Lexer
+// Character classes
 //=============================================================================
 
-// Get next character from source file
+// Input class of every character, indexed by character plus one so that
+// EOF (-1) has an entry of its own
+
+_Static_assert(EOF == -1, "input class table assumes EOF is -1");
+
+const unsigned char input_classes[257] = {
+    [EOF + 1]       = ic_eof,
+    ['\t' + 1]      = ic_whitespace,
+    ['\n' + 1]      = ic_eol,
+    ['\v' + 1]      = ic_whitespace,
+    ['\r' + 1]      = ic_whitespace,
+    [' ' + 1]       = ic_whitespace,
+    ['"' + 1]       = ic_dqmark,
+    ['\'' + 1]      = ic_sqmark,
+    ['%' + 1]       = ic_symbol,
+    ['&' + 1]       = ic_symbol,
+    ['(' + 1]       = ic_symbol,
+    [')' + 1]       = ic_symbol,
+    ['*' + 1]       = ic_symbol,
+    ['+' + 1]       = ic_symbol,
+    ['-' + 1]       = ic_symbol,
+    ['/' + 1]       = ic_symbol,
+    [':' + 1]       = ic_symbol,
+    [';' + 1]       = ic_comment,
+    ['<' + 1]       = ic_symbol,
+    ['>' + 1]       = ic_symbol,
+    ['^' + 1]       = ic_symbol,
+    ['|' + 1]       = ic_symbol,
+    ['~' + 1]       = ic_symbol
+};
+
+// Token type of every symbol. < and > are only symbols when doubled.
+
+const unsigned char symbol_types[256] = {
+    ['%'] = t_percent,
+    ['&'] = t_amp,
+    ['('] = t_lparen,
+    [')'] = t_rparen,
+    ['*'] = t_star,
+    ['+'] = t_plus,
+    ['-'] = t_minus,
+    ['/'] = t_slash,
+    [':'] = t_colon,
+    ['<'] = t_unknown,
+    ['>'] = t_unknown,
+    ['^'] = t_caret,
+    ['|'] = t_pipe,
+    ['~'] = t_tilde
+};
+
+// Flags of every character
+
+#define BIN (cf_bindigit | cf_octdigit | cf_decdigit | cf_hexdigit | cf_visible)
+#define OCT (cf_octdigit | cf_decdigit | cf_hexdigit | cf_visible)
+#define DEC (cf_decdigit | cf_hexdigit | cf_visible)
+#define HEX (cf_letter | cf_hexdigit | cf_visible)
+#define LET (cf_letter | cf_visible)
+
+const unsigned char char_flags[256] = {
+    [' ' ... '/'] = cf_visible,
+    ['0' ... '1'] = BIN,
+    ['2' ... '7'] = OCT,
+    ['8' ... '9'] = DEC,
+    [':' ... '@'] = cf_visible,
+    ['A' ... 'F'] = HEX,
+    ['G' ... 'Z'] = LET,
+    ['[' ... '^'] = cf_visible,
+    ['_']         = cf_underscore | cf_visible,
+    ['`']         = cf_visible,
+    ['a' ... 'f'] = HEX,
+    ['g' ... 'z'] = LET,
+    ['{' ... '~'] = cf_visible
+};
+
+#undef BIN
+#undef OCT
+#undef DEC
+#undef HEX
+#undef LET
+
+// Get input class of character
 
-int get_next_char()
+input_class get_input_class(int c)
 {
-    int c;
-    
-    c = fgetc(src);
-    if (ferror(src)) {
-        fail("Unable to read character from source file");
+    return input_classes[c + 1];
+}
+
+// Get flags of character
+
+int get_char_flags(int c)
+{
+    if (c < 0 || c > 255) {
+        return 0;
     }
-    return c;    
+    return char_flags[c];
 }
 
-// Get next token
+//=============================================================================
+// Lexer context
+//=============================================================================
 
-struct token *get_next_token()
+// Initialize lexer with no source text
+
+void init_lexer(struct lexer *lx)
 {
-    // Tokenizer and Lexer
+    lx->buf = lx->pos = lx->end = NULL;
+    lx->mapped = false;
+    lx->owned = false;
+    lx->fd = -1;
+    lx->window = NULL;
+    lx->size = 0;
+    lx->base = 0;
+    lx->mark = NULL;
+    lx->hold = SIZE_MAX;
+    init_lines(&lx->lines);
+    lx->arena.head = NULL;
+    init_names(&lx->names);
+    lx->intern = true;
+    lx->defer = false;
+    init_diagnostics(&lx->deferred);
+    lx->errors = 0;
+}
 
-    /*
-    -------------   -----------------   ----------  -----------------------------
-    current state   input               next state  action
-    -------------   -----------------   ----------  -----------------------------
-    1               whitespace          1           ignore input; get next input
-    1               symbol              2           do nothing
-    1               eol                 3           do nothing    
-    1               eof                 4           do nothing    
-    1               sq.mark             5           do nothing
-    1               dq.mark             6           do nothing
-    1               comment initiator   7           do nothing
-    1               anything else       8           do nothing
-    2               ':'                 0           capture input; get next input
-    3               eol                 0           capture input; get next input
-    4               eof                 0           capture input; get next input
-    5               sq.mark             5.1         capture input; get next input
-    5.1             sq.mark             0           capture input; get next input
-    5.1             eol                 0           do nothing
-    5.1             eof                 0           do nothing
-    5.1             comment initiator   0           do nothing
-    5.1             anything else       5.1         capture input; get next input
-    6               dq.mark             6.1         capture input; get next input
-    6.1             dq.mark             0           capture input; get next input
-    6.1             eol                 0           do nothing
-    6.1             eof                 0           do nothing
-    6.1             comment initiator   0           do nothing
-    6.1             anything else       6.1         capture input; get next input
-    7               eol                 1           do nothing
-    7               eof                 1           do nothing
-    7               anything else       7           ignore input; get next input
-    8               whitespace          0           do nothing
-    8               symbol              0           do nothing
-    8               eol                 0           do nothing
-    8               eof                 0           do nothing
-    8               sq.mark             0           do nothing
-    8               dq.mark             0           do nothing
-    8               comment initiator   0           do nothing
-    8               anything else       8           capture input; get next input
-    0               lexeme              -           ...    
-    -------------   -----------------   ----------  -----------------------------
-    */
-    
-    typedef enum state {
-        S0,     // State 0      ...
-        S1,     // State 1      ...
-        S2,     // State 2      ...
-        S3,     // State 3      ...
-        S4,     // State 4      ...
-        S5,     // State 5      ...
-        S5_1,   // State 5.1    ...
-        S6,     // State 6      ...
-        S6_1,   // State 6.1    ...
-        S7,     // State 7      ...
-        S8      // State 8      ...
-    } state;
-    
-    state current_state; // current state
-    state next_state;    // next state
-    bool done;           // used to indicate end of tokenization process
-    struct token *token; // token
+// Open lexer on source file
 
-    token = create_token();
-    flush_lexeme(token);
-    
-    done = false;
-    next_state = S1;
-    
-    while (!done) {
-    
-        current_state = next_state;
-        
-        switch(current_state) {
+void open_lexer(struct lexer *lx, FILE *fp)
+{
+    // Regular files are loaded whole. Pipes, terminals and other streams
+    // are read through a window of fixed size as the lexer goes, so they
+    // are lexed in constant memory.
 
-            // Tokenizer
-            
-            case S1:
-                if (is_whitespace(input)) {
-                    input = get_next_char();
-                    next_state = current_state;
-                }
-                else if (is_symbol(input)) {
-                    next_state = S2;
-                }
-                else if (is_eol(input)) {
-                    next_state = S3;
-                }
-                else if (is_eof(input)) {
-                    next_state = S4;
-                }
-                else if (is_sqmark(input)) {
-                    next_state = S5;
-                }
-                else if (is_dqmark(input)) {
-                    next_state = S6;
-                }
-                else if (is_comment_initor(input)) {
-                    next_state = S7;
-                }
-                else {
-                    next_state = S8;
-                }
-                break;
-                
-            case S2:
-                if (input == ':') {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = S0;
-                }
-                break;
-                
-            case S3:
-                if (is_eol(input)) {
-                    token->eol = true;
-                    input = get_next_char();
-                    next_state = S0;
-                }
-                break;
-                
-            case S4:
-                if (is_eof(input)) {
-                    token->eof = true;
-                    input = get_next_char();
-                    next_state = S0;
-                }
-                break;
-                
-            case S5:
-                if (is_sqmark(input)) {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = S5_1;
-                }
-                break;
-                
-            case S5_1:
-                if (is_sqmark(input)) {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = S0;
-                }
-                else if (is_eol(input)) {
-                    next_state = S0;
-                }
-                else if (is_eof(input)) {
-                    next_state = S0;
-                }
-                else if (is_comment_initor(input)) {
-                    next_state = S0;
-                }
-                else {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = current_state;
-                }
-                break;
-                
-            case S6:
-                if (is_dqmark(input)) {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = S6_1;
-                }
-                break;
-                
-            case S6_1:
-                if (is_dqmark(input)) {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = S0;
-                }
-                else if (is_eol(input)) {
-                    next_state = S0;
-                }
-                else if (is_eof(input)) {
-                    next_state = S0;
-                }
-                else if (is_comment_initor(input)) {
-                    next_state = S0;
-                }
-                else {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = current_state;
-                }
-                break;
-                
-            case S7:
-                if (is_eol(input)) {   
-                    next_state = S1;
-                }
-                else if (is_eof(input)) {
-                    next_state = S1;
-                }
-                else {
-                    input = get_next_char();
-                    next_state = current_state;
-                }
-                break;
-                
-            case S8:
-                if (is_whitespace(input)) {
-                    next_state = S0;
-                }
-                else if (is_symbol(input)) {
-                    next_state = S0;
-                }
-                else if (is_eol(input)) {
-                    next_state = S0;
-                }
-                else if (is_eof(input)) {
-                    next_state = S0;
-                }
-                else if (is_sqmark(input)) {
-                    next_state = S0;
-                }
-                else if (is_dqmark(input)) {
-                    next_state = S0;
-                }
-                else if (is_comment_initor(input)) {
-                    next_state = S0;
-                }
-                else {
-                    push_to_lexeme(token, input);
-                    input = get_next_char();
-                    next_state = current_state;
-                }
-                break;
+    struct stat st;
 
-            // Lexer
-                
-            case S0:
-            
-                done = true;
-                
-                if (token->eol) {
-                    token->type = t_eol;
-                }
-                else if (token->eof) {
-                    token->type = t_eof;
-                }
-                else if (is_terminal(":",token->lexeme)) {
-                    token->type = t_colon;
-                }
-                else if (is_bin(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_bin(token->lexeme);
-                }
-                else if (is_oct(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_oct(token->lexeme);
-                }
-                else if (is_dec(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_dec(token->lexeme);
-                }
-                else if (is_hex(token->lexeme)) {
-                    token->type = t_int;
-                    token->intval = eval_hex(token->lexeme);
-                }
-                else if (is_id(token->lexeme)) {
-                    token->type = t_id;
-                }
-                else if (is_sqstr(token->lexeme)) {
-                    token->type = t_squote;
-                    token->strval = eval_sqstr(token->lexeme);
-                }
-                else if (is_dqstr(token->lexeme)) {
-                    token->type = t_dquote;
-                    token->strval = eval_dqstr(token->lexeme);
-                }
-                else {
-                    token->type = t_unknown;
-                }
-                break;
-        }
+    if (fstat(fileno(fp),&st) == 0 && !S_ISREG(st.st_mode)) {
+        open_stream_lexer(lx,fileno(fp),STREAM_WINDOW_SIZE);
+        return;
     }
-    return token;
-}
+    init_lexer(lx);
+    load_source(lx,fp);
 
-// TOKEN OPERATIONS
+    // Get first character for the lexer to start with
+    lx->input = get_next_char(lx);
+}
 
-// Create new token
+// Open lexer on source text held by the caller
 
-struct token *create_token()
+void open_lexer_buffer(struct lexer *lx, const char *buf, size_t len)
 {
-    struct token *p;
-    p = emalloc(sizeof(struct token));
-    p->eol = false;
-    p->eof = false;
-    return p;
+    // The text must outlive the lexer and is not released by it
+    init_lexer(lx);
+    lx->buf = buf;
+    lx->pos = buf;
+    lx->end = buf + len;
+    lx->input = get_next_char(lx);
 }
 
-// Push character to lexeme
+// Open lexer on source text streamed from descriptor
 
-void push_to_lexeme(struct token *p, int c)
+void open_stream_lexer(struct lexer *lx, int fd, size_t size)
 {
-    if (p->top == 256) {
-        fail("Something went wrong. Overflow occurred on lexeme stack");
-    }
-    
-    p->lexeme[p->top++] = c;
-    p->lexeme[p->top] = '\0';
+    // The descriptor must stay open until the lexer is closed. Lexemes,
+    // and the text returned by get_lexeme() and get_strval(), are only
+    // in the window until the lexer reads on, so a token must be used
+    // before the next one is scanned. The window starts at the given size
+    // and grows only for lexemes that do not fit.
+    init_lexer(lx);
+    lx->fd = fd;
+    lx->size = size;
+    lx->window = emalloc(lx->size);
+    lx->buf = lx->pos = lx->end = lx->window;
+    lx->input = get_next_char(lx);
 }
 
-// Pop character from lexeme
+// Close lexer
 
-int pop_from_lexeme(struct token *p)
+void close_lexer(struct lexer *lx)
 {
-    int c;
-    
-    if (p->top == -1) {
-        fail("Something went wrong. Underflow occurred on lexeme stack");
-    }
-    
-    p->top--;
-    c = p->lexeme[p->top];
-    p->lexeme[p->top] = '\0';
-    
-    return c;
+    // Everything the lexer allocated for this source lives in its arena, so
+    // it is released in one shot.
+    arena_release(&lx->arena);
+    release_names(&lx->names);
+    release_lines(&lx->lines);
+    release_diagnostics(&lx->deferred);
+    unload_source(lx);
+#ifdef INSTRUMENT
+    merge_counts();
+#endif
+#ifdef TRACE
+    flush_trace();
+#endif
 }
 
-// Flush lexeme
+// Report error found by lexer
 
-void flush_lexeme(struct token *p)
+void lexer_error(struct lexer *lx, size_t offset, const char *format, ... )
 {
-    p->top = 0;
-    p->lexeme[p->top] = '\0';
+    // A lexer that defers its errors keeps them, located, for its owner to
+    // report in source order
+    char s[1024];
+    char text[1100];
+    size_t line;
+    size_t column;
+    va_list args;
+    va_start(args,format);
+    vsnprintf(s,sizeof(s),format,args);
+    va_end(args);
+    TRACE_EVENT(te_error,0,offset,0,0);
+    if (locate_offset(lx,offset,&line,&column)) {
+        snprintf(text,sizeof(text),"Line %zu, column %zu: %s",line,column,s);
+    }
+    else {
+        snprintf(text,sizeof(text),"%s",s);
+    }
+    if (lx->defer) {
+        add_diagnostic(&lx->deferred,offset,text);
+    }
+    else {
+        error("%s",text);
+    }
+    lx->errors++;
 }
 
-// EVALUATORS
+//=============================================================================
+// Source input
+//=============================================================================
 
-// Evaluate binary
+// Load source text
 
-int eval_bin(const char *s)
+void load_source(struct lexer *lx, FILE *fp)
 {
-    // Remove appended symbol and evaluate a binary number
-    char *p;
-    p = dupstr(s);
-    p[strlen(p)-1] = '\0';
-    printf(" %s ",p);
-    return eval(p,2);
-}
+    // Map the source file into memory so the lexer can walk a pointer over
+    // its bytes instead of calling stdio for every character. Inputs that
+    // cannot be mapped (pipes, terminals, empty files) are read into memory.
 
-// Evaluate octal
+    struct stat st;
+    void *p;
 
-int eval_oct(const char *s)
-{   
-    char *p;
-    p = dupstr(s);
-    p[strlen(p)-1] = '\0';
-    printf(" %s ",p);
-    return eval(p,8);
+    if (fstat(fileno(fp),&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        p = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fileno(fp),0);
+        if (p != MAP_FAILED) {
+            madvise(p,st.st_size,MADV_SEQUENTIAL);
+            lx->buf = p;
+            lx->pos = lx->buf;
+            lx->end = lx->buf + st.st_size;
+            lx->mapped = true;
+            lx->owned = true;
+            return;
+        }
+    }
+    read_source(lx,fp);
 }
 
-// Evaluate decimal
+// Read source text into memory
 
-int eval_dec(const char *s)
+void read_source(struct lexer *lx, FILE *fp)
 {
-    // Evaluate a decimal. Unlike other number systems, decimals are valid
-    // with or without the appended symbol. Check for the symbol and remove
-    // it if necessary before evaluating the decimal.
-
-    char *p;
-
-    p = dupstr(s);
-    if (tolowercase(s[strlen(s)-1]) == 'd') {
-        p[strlen(p)-1] = '\0';
-        printf(" %s ",p);
-        return eval(p,10);
+    char *buf;   // buffer holding source text
+    size_t size; // size of buffer
+    size_t len;  // number of bytes read so far
+    size_t n;    // number of bytes read by last call
+
+    size = 65536;
+    len = 0;
+    buf = emalloc(size);
+
+    while ((n = fread(buf+len,1,size-len,fp)) > 0) {
+        len += n;
+        if (len == size) {
+            size *= 2;
+            buf = erealloc(buf,size);
+        }
     }
-    else {
-        printf(" %s ",p);
-        return eval(p,10);
+    if (ferror(fp)) {
+        fail("Unable to read source file");
     }
-}
-
-// Evaluate hexadecimal
 
-int eval_hex(const char *s)
-{
-    char *p;
-    p = dupstr(s);
-    p[strlen(p)-1] = '\0';
-    printf(" %s ",p);
-    return eval(p,16);
+    lx->buf = buf;
+    lx->pos = lx->buf;
+    lx->end = lx->buf + len;
+    lx->mapped = false;
+    lx->owned = true;
 }
 
-// Evaluator
+// Release source text
 
-int eval(const char *s, int base)
+void unload_source(struct lexer *lx)
 {
-    int i;       // loop counter
-    int val;     // stores integer value of digit
-    int integer; // stores converted integer
-    int place;   // stores place value
-    
-    integer = 0; // zero it
-    place = 1;   // start at place value 1
-    
-    // Convert the given string to an integer value. Starting from end of
-    // string and working our way to the beginning, get the integer value
-    // for each digit and calculate its corresponding place value.
-    // Sum the calculated place value for each digit.
-        
-    for(i=strlen(s)-1; i>=0; i--) {
-        val = get_value(s[i]);          // get the value of the current digit
-        integer += val * place;         // put digit in specified place value
-        place *= base;                  // go to next place value
+    if (lx->mapped) {
+        munmap((void *)lx->buf,lx->end-lx->buf);
     }
-    return integer;
+    else if (lx->owned) {
+        free((void *)lx->buf);
+    }
+    free(lx->window);
+    lx->window = NULL;
+    lx->buf = lx->pos = lx->end = NULL;
 }
 
-// Lookup digit value
+// Read more streamed source text into window
 
-int get_value(int c)
+bool refill_source(struct lexer *lx)
 {
-    // Get the digit value of any digit. To do this, we use a lookup table,
-    // a simple character array. This array is a map. Each digit maps to its
-    // corresponding integer value.
+    // Called when the lexer has used up the window. Only the lexeme being
+    // captured, if any, is still needed; it moves to the front of the
+    // window and the rest of the window is filled from the descriptor. A
+    // lexeme as big as the whole window makes the window grow. Returns
+    // false at the end of the source text.
 
-    int i; // indexer
-    char d[] = "0123456789abcdef"; // table map
-    
-    // Search table for digit and return its corresponding integer value
-    for (i=0; i<strlen(d); i++) {
-        if (tolowercase(c) == d[i]) {
-            return i;
-        }
+    const char *keep; // first character still needed
+    size_t kept;      // number of characters still needed
+    ssize_t n;        // number of characters read
+
+    if (lx->fd < 0) {
+        return false;
     }
 
-    // Return an indicator if no match
-    return -1;
+    keep = lx->mark ? lx->mark : lx->end;
+    kept = lx->end - keep;
+
+    // Text before the kept part is about to go, so its newlines are counted
+    // now; otherwise later positions could not be located. Those from the
+    // held offset on stay in the index, so the text there can still be
+    // located once it is gone.
+    index_lines(lx,lx->base + (keep - lx->buf));
+    drop_lines(lx,lx->base + (keep - lx->buf) < lx->hold ? lx->base + (keep - lx->buf) : lx->hold);
+
+    lx->base += keep - lx->buf;
+    memmove(lx->window,keep,kept);
+    if (kept == lx->size) {
+        lx->size *= 2;
+        lx->window = erealloc(lx->window,lx->size);
+    }
+    if (lx->mark) {
+        lx->mark = lx->window;
+    }
+
+    do {
+        n = read(lx->fd,lx->window+kept,lx->size-kept);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        fail("Unable to read source file");
+    }
+    TRACE_EVENT(te_refill,0,lx->base + kept,n,0);
+
+    lx->buf = lx->window;
+    lx->pos = lx->window + kept;
+    lx->end = lx->pos + n;
+    if (n == 0) {
+        lx->fd = -1;
+        return false;
+    }
+    return true;
 }
 
-// Evaluate single-quote string
+//=============================================================================
+// Source positions
+//=============================================================================
 
-char *eval_sqstr(char *s)
-{
-    // This assembler features simple string syntax. So, only remove the quotation marks.
+// Initialize newline index
 
-    char *p;
-    p = substr(s+1,strlen(s)-2);
-    return p;
+void init_lines(struct line_index *ix)
+{
+    ix->eols = NULL;
+    ix->count = 0;
+    ix->size = 0;
+    ix->start = 0;
+    ix->scanned = 0;
+    ix->line = 0;
+    ix->line_start = 0;
 }
 
-// Evaluate double-quote string
+// Release newline index
 
-char *eval_dqstr(char *s)
+void release_lines(struct line_index *ix)
 {
-    return eval_sqstr(s);
+    free(ix->eols);
+    init_lines(ix);
 }
 
-// TERMINAL RECOGNIZER
+// Make room for more newlines
 
-// Match token to terminal
+void grow_lines(struct line_index *ix)
+{
+    ix->size = ix->size ? ix->size * 2 : 4096;
+    ix->eols = erealloc(ix->eols,ix->size * sizeof(size_t));
+}
+
+// Index newlines up to given offset
 
-bool is_terminal(const char *terminal, const char *token)
+void index_lines(struct lexer *lx, size_t offset)
 {
-    if (strcmp(terminal,token) == 0) {
-        return true;
+    struct line_index *ix = &lx->lines;
+
+    if (offset <= ix->scanned) {
+        return;
     }
-    return false;
+    scan_newlines(ix,lx->buf + (ix->scanned - lx->base),lx->buf + (offset - lx->base),ix->scanned);
+    ix->scanned = offset;
 }
 
-// LOW-LEVEL RECOGNIZERS
+// Forget newlines before given offset, keeping their count
 
-// Recognize identifier
+void drop_lines(struct lexer *lx, size_t offset)
+{
+    struct line_index *ix = &lx->lines;
+    size_t n; // number of newlines before offset
+
+    if (offset <= ix->start) {
+        return;
+    }
+    index_lines(lx,offset);
+    for (n=0; n<ix->count && ix->eols[n] < offset; n++);
+    if (n) {
+        ix->line += n;
+        ix->line_start = ix->eols[n - 1] + 1;
+        ix->count -= n;
+        memmove(ix->eols,ix->eols + n,ix->count * sizeof(size_t));
+    }
+    ix->start = offset;
+}
 
-bool is_id(const char *s)
+// Get line and column of offset
+
+bool locate_offset(struct lexer *lx, size_t offset, size_t *line, size_t *column)
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
-    
-    i = 0;
-    done = false;
-    next_state = 2;
-    
-    while (!done) { 
-    
-        c = s[i++];
-        current_state = next_state;
-        
-        switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
-                
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
-            
-                // Valid
-                
-                validity = true;
-                done = true;
-                break;
-                
-            case 2:
-            
-                // Accept either a letter or an underscore; deny anything else.
-                
-                if (is_letter(c) || is_underscore(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 3:
-            
-                // Accept zero or more letters, digits or underscore characters;
-                // deny anything else.
-                
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else if (is_letter(c) || is_digit(c) || is_underscore(c)) {
-                    next_state = current_state;
-                }
-                else {
-                    next_state = 0;
-                }
-                break; 
+    // Lines and columns count from 1. Fails for text a streaming lexer has
+    // already let go of.
+
+    struct line_index *ix = &lx->lines;
+    size_t lo, hi, mid; // bounds of binary search
+
+    if (offset < ix->start || offset > lx->base + (size_t)(lx->end - lx->buf)) {
+        return false;
+    }
+    index_lines(lx,offset);
+
+    // Count the newlines before the offset
+    lo = 0;
+    hi = ix->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ix->eols[mid] < offset) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
         }
     }
-    return validity;
+
+    *line = ix->line + lo + 1;
+    *column = offset - (lo ? ix->eols[lo - 1] + 1 : ix->line_start) + 1;
+    return true;
 }
 
-// Recognize any integer representation
+//=============================================================================
+// Parallel lexing
+//=============================================================================
+
+// Lex source text on several threads
 
-bool is_int(const char *s)
+void lex_parallel(struct lexer *lx, int nthreads, struct token_list *out)
 {
-    if (is_bin(s) || is_oct(s) || is_dec(s) || is_hex(s)) { 
-        return true;
+    // No token crosses a newline: strings and comments end at the EOL like
+    // everything else. So the source text is cut into one shard per thread
+    // just after a newline, each shard is lexed on its own, and the token
+    // lists are stitched back together in order, dropping the EOF token of
+    // every shard but the last. Shards only hash identifiers; they are interned
+    // here, in source order, so IDs come out the same as from a serial run.
+    // Shards hold their errors back too. They are handed to the lexer in
+    // source order, for the lookahead to report as the parser reaches them,
+    // so errors come out in the same order as from a serial run.
+
+    struct shard *shards; // shards of source text
+    pthread_t *threads;   // threads lexing shards
+    size_t len;           // length of source text
+    size_t start;         // start of current shard
+    size_t end;           // end of current shard
+    size_t count;         // number of tokens kept from shard
+    size_t i, j;          // loop counters
+    struct token *p;      // token being stitched
+
+    len = lx->end - lx->buf;
+    shards = emalloc(nthreads * sizeof(struct shard));
+    threads = emalloc(nthreads * sizeof(pthread_t));
+
+    start = 0;
+    for (i=0; i<(size_t)nthreads; i++) {
+        if (i == (size_t)nthreads - 1) {
+            end = len;
+        }
+        else {
+            end = split_source(lx->buf,start + (len - start) / (nthreads - i),len);
+        }
+        shards[i].buf = lx->buf;
+        shards[i].start = start;
+        shards[i].len = end - start;
+        start = end;
     }
-    return false;
+
+    // The calling thread lexes the first shard itself
+    for (i=1; i<(size_t)nthreads; i++) {
+        if (pthread_create(&threads[i],NULL,lex_shard,&shards[i]) != 0) {
+            fail("Unable to create lexer thread");
+        }
+    }
+    lex_shard(&shards[0]);
+    for (i=1; i<(size_t)nthreads; i++) {
+        pthread_join(threads[i],NULL);
+    }
+
+    out->count = 0;
+    out->size = 0;
+    for (i=0; i<(size_t)nthreads; i++) {
+        out->size += shards[i].tokens.count;
+    }
+    out->tokens = emalloc(out->size * sizeof(struct token));
+
+    for (i=0; i<(size_t)nthreads; i++) {
+        count = shards[i].tokens.count;
+        if (i != (size_t)nthreads - 1) {
+            count--;
+        }
+        p = out->tokens + out->count;
+        memcpy(p,shards[i].tokens.tokens,count * sizeof(struct token));
+        for (j=0; j<count; j++) {
+            if (p[j].type == t_id) {
+                p[j].id = intern_name(&lx->names,lx->buf+p[j].offset,p[j].length,p[j].hash);
+            }
+        }
+        out->count += count;
+        lx->errors += shards[i].errors;
+        for (j=0; j<shards[i].diagnostics.count; j++) {
+            add_diagnostic(&lx->deferred,shards[i].diagnostics.items[j].offset,shards[i].diagnostics.items[j].text);
+        }
+        release_diagnostics(&shards[i].diagnostics);
+        release_token_list(&shards[i].tokens);
+    }
+
+    free(threads);
+    free(shards);
 }
 
-// Recognize binary numeral
+// Lex one shard of source text
 
-bool is_bin(const char *s)
+void *lex_shard(void *arg)
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
-    
-    i = 0;
-    done = false;
-    next_state = 2;
-    
-    while (!done) { 
-    
-        c = s[i++];
-        current_state = next_state;
-        
-        switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
-                
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
-            
-                // Valid
-                
-                validity = true;
-                done = true;
-                break;
-                
-            case 2:
-            
-                // Accept one binary digit. Deny anything else
-                
-                if (is_bindigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 3:
-            
-                // Accept zero or more binary digits. Deny anything else.
-                
-                if (is_bindigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_binsym(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 4:
-            
-                // Accept EOS; deny anything else.
-                
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-        }
+    struct shard *sh;   // shard to lex
+    struct lexer lx;    // lexer private to this thread
+    struct token token; // current token
+
+    sh = arg;
+    sh->tokens.tokens = NULL;
+    sh->tokens.count = 0;
+    sh->tokens.size = 0;
+
+    // The lexer sees the whole source text but starts and stops at the ends
+    // of the shard, so offsets and diagnostics refer to the whole text.
+    init_lexer(&lx);
+    lx.buf = sh->buf;
+    lx.pos = sh->buf + sh->start;
+    lx.end = lx.pos + sh->len;
+    lx.input = get_next_char(&lx);
+    lx.intern = false;
+    lx.defer = true;
+
+    // The token being scanned lives on the stack and is copied out as it is
+    // found, so nothing is allocated per token.
+    do {
+        init_token(&token);
+        scan_token(&lx,&token);
+        append_token(&sh->tokens,&token);
+    } while (token.type != t_eof);
+    sh->errors = lx.errors;
+    sh->diagnostics = lx.deferred;
+    init_diagnostics(&lx.deferred);
+    close_lexer(&lx);
+    return NULL;
+}
+
+// Find split point in source text
+
+size_t split_source(const char *buf, size_t offset, size_t len)
+{
+    // Return the offset just after the first newline at or after the given
+    // offset, or the end of the source text if there is none.
+
+    const char *p;
+
+    if (offset >= len) {
+        return len;
     }
-    
-    return validity;
+    p = memchr(buf + offset,'\n',len - offset);
+    if (!p) {
+        return len;
+    }
+    return p - buf + 1;
 }
 
-// Recognize octal numeral
+// Append token to token list
 
-bool is_oct(const char *s)
+void append_token(struct token_list *list, const struct token *token)
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
-    
-    i = 0;
-    done = false;
-    next_state = 2;
-    
-    while (!done) {
-    
-        c = s[i++];
-        current_state = next_state;
-        
-        switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
-                
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
-            
-                // Valid
-                
-                validity = true;
-                done = true;
-                break;
-                
-            case 2:
-            
-                // Accept one octal digit; deny anything else.
-                
-                if (is_octdigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 3:
-            
-                // Accept zero or more octal digits; deny anything else.
-                
-                if (is_octdigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_octsym(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 4:
-            
-                // Accept EOS; deny anything else.
-                
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-        }
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 4096;
+        list->tokens = erealloc(list->tokens,list->size * sizeof(struct token));
     }
-    return validity;
+    list->tokens[list->count++] = *token;
 }
 
-// Recognize decimal numeral
+// Release token list
 
-bool is_dec(const char *s)
+void release_token_list(struct token_list *list)
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
-    
-    i = 0;
-    done = false;
-    next_state = 2;
-    
-    while (!done) { 
-    
-        c = s[i++];
-        current_state = next_state;
-        
-        switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
-                
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
-            
-                // Valid
-            
-                validity = true;
-                done = true;
-                break;
-                
-            case 2:
-                
-                // Accept one decimal digit; deny anything else.
-            
-                if (is_decdigit(c)) {
-                    next_state = 3;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 3:
-            
-                // Accept zero or more decimal digits; deny anything else.
-            
-                if (is_decdigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_decsym(c)) {
-                    next_state = 4;
-                }
-                else if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 4:
-            
-                // Accept EOS; deny anything else.
-                
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
+    free(list->tokens);
+    list->tokens = NULL;
+    list->count = 0;
+    list->size = 0;
+}
+
+// Initialize diagnostic list
+
+void init_diagnostics(struct diagnostic_list *list)
+{
+    list->items = NULL;
+    list->count = 0;
+    list->size = 0;
+    list->next = 0;
+}
+
+// Release diagnostic list
+
+void release_diagnostics(struct diagnostic_list *list)
+{
+    size_t i;
+
+    for (i=0; i<list->count; i++) {
+        free(list->items[i].text);
+    }
+    free(list->items);
+    init_diagnostics(list);
+}
+
+// Append diagnostic to list
+
+void add_diagnostic(struct diagnostic_list *list, size_t offset, const char *text)
+{
+    struct diagnostic *d; // diagnostic added
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 16;
+        list->items = erealloc(list->items,list->size * sizeof(struct diagnostic));
+    }
+    d = &list->items[list->count++];
+    d->offset = offset;
+    d->text = emalloc(strlen(text) + 1);
+    strcpy(d->text,text);
+}
+
+// Report errors held back before given offset
+
+void report_deferred(struct lexer *lx, size_t offset)
+{
+    struct diagnostic_list *list = &lx->deferred;
+
+    while (list->next < list->count && list->items[list->next].offset < offset) {
+        error("%s",list->items[list->next].text);
+        list->next++;
+    }
+}
+
+//=============================================================================
+// Lookahead
+//=============================================================================
+
+// Initialize lookahead on lexer
+
+void init_lookahead(struct lookahead *la, struct lexer *lx)
+{
+    la->lx = lx;
+    la->list = NULL;
+    la->head = 0;
+    la->tail = 0;
+}
+
+// Initialize lookahead on tokens already lexed
+
+void init_lookahead_list(struct lookahead *la, struct lexer *lx, const struct token_list *list)
+{
+    // The list must end with the EOF token, as lex_parallel() leaves it.
+    // The lexer only supplies the source text and identifier table.
+    init_lookahead(la,lx);
+    la->list = list;
+}
+
+// Peek at token k places after current token
+
+const struct token *peek_token(struct lookahead *la, size_t k)
+{
+    // Tokens are scanned straight into the ring as far as needed, and k
+    // must be less than LOOKAHEAD_SIZE. Past the end of the source text
+    // every token is the EOF token. The lexeme of a streamed token may
+    // already have left the window, so only its type and value can be
+    // relied on once later tokens have been peeked at.
+
+    struct token *p;    // token being scanned
+    struct token *last; // token scanned before it
+
+    if (k >= LOOKAHEAD_SIZE) {
+        fail("Cannot look %zu tokens ahead",k);
+    }
+    while (la->tail - la->head <= k) {
+        p = &la->tokens[la->tail & (LOOKAHEAD_SIZE - 1)];
+        last = &la->tokens[(la->tail - 1) & (LOOKAHEAD_SIZE - 1)];
+        if (la->tail > 0 && last->type == t_eof) {
+            *p = *last;
         }
+        else if (la->list) {
+            // Errors the lexer found up to this token are reported now, as
+            // a serial lexer would have while scanning it
+            *p = la->list->tokens[la->tail];
+            report_deferred(la->lx,p->type == t_eof ? SIZE_MAX : p->offset + p->length);
+        }
+        else {
+            init_token(p);
+            scan_token(la->lx,p);
+        }
+        la->tail++;
     }
-    return validity;
+    return &la->tokens[(la->head + k) & (LOOKAHEAD_SIZE - 1)];
 }
 
-// Recognize hexadecimal numeral
+// Move on to next token
 
-bool is_hex(const char *s)
+void advance_token(struct lookahead *la)
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
+    if (la->tail == la->head) {
+        peek_token(la,0);
+    }
+    la->head++;
+}
+
+//=============================================================================
+// Lexer
+//=============================================================================
+
+// Get next character from source text
+
+int get_next_char(struct lexer *lx)
+{
+    if (lx->pos == lx->end && !refill_source(lx)) {
+        return EOF;
+    }
+    return (unsigned char)*lx->pos++;
+}
+
+// Skip run of whitespace
+
+void skip_whitespace(struct lexer *lx)
+{
+    // The current input is whitespace; move to the first character after
+    // the run.
+    lx->pos = skip_blanks(lx->pos,lx->end);
+    lx->input = get_next_char(lx);
+}
+
+// Skip to end of line
+
+void skip_to_eol(struct lexer *lx)
+{
+    // The current input is inside a comment; move to the EOL or EOF that
+    // ends it.
+
+    const char *p; // EOL or EOF ending comment
+
+    p = find_eol(lx->pos,lx->end);
+    COUNT(comment_bytes,p - lx->pos + 1);
+    lx->pos = p;
+    lx->input = get_next_char(lx);
+}
+
+// Get offset of current input character in source text
+
+size_t get_input_offset(struct lexer *lx)
+{
+    if (lx->input == EOF) {
+        return lx->base + (lx->pos - lx->buf);
+    }
+    return lx->base + (lx->pos - lx->buf) - 1;
+}
+
+// Get next token
+
+struct token *get_next_token(struct lexer *lx)
+{
+    struct token *token;
+    token = create_token(lx);
+    scan_token(lx,token);
+    return token;
+}
+
+// Get block of next tokens
+
+size_t lex_batch(struct lexer *lx, struct token_block *block)
+{
+    // Fill the caller's block with up to TOKEN_BLOCK_SIZE tokens, stopping
+    // after the EOF token. The token being scanned lives on the stack, so
+    // nothing is allocated per token.
+
+    struct token token;
+    size_t n;
+
+    n = 0;
+    do {
+        init_token(&token);
+        scan_token(lx,&token);
+        if (token.offset + token.length > UINT32_MAX) {
+            fail("Source text is too large for a token block");
+        }
+        block->types[n] = token.type;
+        block->offsets[n] = token.offset;
+        block->lengths[n] = token.length;
+        block->values[n] = token.type == t_id ? token.id : token.intval;
+        n++;
+    } while (n < TOKEN_BLOCK_SIZE && token.type != t_eof);
+
+    block->count = n;
+    return n;
+}
+
+// Scan next token into given token
+
+void scan_token(struct lexer *lx, struct token *token)
+{
+    // Tokenizer and Lexer
+
+    /*
+    -------------   -----------------   ----------  -----------------------------
+    current state   input               next state  action
+    -------------   -----------------   ----------  -----------------------------
+    1               whitespace          1           ignore input; get next input
+    1               symbol              2           do nothing
+    1               eol                 3           do nothing    
+    1               eof                 4           do nothing    
+    1               sq.mark             5           do nothing
+    1               dq.mark             6           do nothing
+    1               comment initiator   7           do nothing
+    1               anything else       8           do nothing
+    2               symbol              0           capture input; get next input
+                                                    (and again for << or >>)
+    3               eol                 0           capture input; get next input
+    4               eof                 0           capture input; get next input
+    5               sq.mark             5.1         capture input; get next input
+    5.1             sq.mark             0           capture input; get next input
+    5.1             eol                 0           do nothing
+    5.1             eof                 0           do nothing
+    5.1             comment initiator   0           do nothing
+    5.1             anything else       5.1         capture input; get next input
+    6               dq.mark             6.1         capture input; get next input
+    6.1             dq.mark             0           capture input; get next input
+    6.1             eol                 0           do nothing
+    6.1             eof                 0           do nothing
+    6.1             comment initiator   0           do nothing
+    6.1             anything else       6.1         capture input; get next input
+    7               eol                 1           do nothing
+    7               eof                 1           do nothing
+    7               anything else       7           ignore input; get next input
+    8               whitespace          0           do nothing
+    8               symbol              0           do nothing
+    8               eol                 0           do nothing
+    8               eof                 0           do nothing
+    8               sq.mark             0           do nothing
+    8               dq.mark             0           do nothing
+    8               comment initiator   0           do nothing
+    8               anything else       8           capture input; get next input
+    0               lexeme              -           ...    
+    -------------   -----------------   ----------  -----------------------------
+    */
     
-    i = 0;
+    typedef enum state {
+        S0,     // State 0      ...
+        S1,     // State 1      ...
+        S2,     // State 2      ...
+        S3,     // State 3      ...
+        S4,     // State 4      ...
+        S5,     // State 5      ...
+        S5_1,   // State 5.1    ...
+        S6,     // State 6      ...
+        S6_1,   // State 6.1    ...
+        S7,     // State 7      ...
+        S8      // State 8      ...
+    } state;
+    
+    state current_state; // current state
+    state next_state;    // next state
+    bool done;           // used to indicate end of tokenization process
+    const char *lexeme;  // lexeme of token in source text
+    size_t len;          // length of lexeme
+    int value;           // value of integer lexeme
+    int c;               // first character of two-character symbol
+#ifdef INSTRUMENT
+    size_t start;        // offset scanning started at
+    start = get_input_offset(lx);
+    _Static_assert(S8 + 1 == LEXER_STATES,"LEXER_STATES must match the tokenizer");
+#endif
+
+    lx->mark = NULL;
     done = false;
-    next_state = 2;
+    current_state = S0;
+    next_state = S1;
     
-    while (!done) { 
+    while (!done) {
     
-        c = s[i++];
+        COUNT(transitions[current_state][next_state],1);
         current_state = next_state;
         
         switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
-                
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
+
+            // Tokenizer
             
-                // Valid
-                
-                validity = true;
-                done = true;
+            case S1:
+                switch (get_input_class(lx->input)) {
+                    case ic_whitespace:
+                        skip_whitespace(lx);
+                        next_state = current_state;
+                        break;
+                    case ic_symbol:
+                        next_state = S2;
+                        break;
+                    case ic_eol:
+                        next_state = S3;
+                        break;
+                    case ic_eof:
+                        next_state = S4;
+                        break;
+                    case ic_sqmark:
+                        next_state = S5;
+                        break;
+                    case ic_dqmark:
+                        next_state = S6;
+                        break;
+                    case ic_comment:
+                        next_state = S7;
+                        break;
+                    default:
+                        next_state = S8;
+                        break;
+                }
                 break;
                 
-            case 2:
-            
-                // Accept one hex digit; deny anything else.
-                
-                if (is_hexdigit(c)) {
-                    next_state = 3;
+            case S2:
+                // Every symbol is a token of its own. The tokenizer types
+                // it, so the classifier never sees it.
+                capture_lexeme(lx,token);
+                token->type = symbol_types[lx->input];
+                if (lx->input == '<' || lx->input == '>') {
+                    c = lx->input;
+                    lx->input = get_next_char(lx);
+                    if (lx->input == c) {
+                        capture_lexeme(lx,token);
+                        token->type = c == '<' ? t_shl : t_shr;
+                        lx->input = get_next_char(lx);
+                    }
                 }
                 else {
-                    next_state = 0;
+                    lx->input = get_next_char(lx);
                 }
+                next_state = S0;
                 break;
                 
-            case 3:
-            
-                // Accept zero or more hex digits; or accept hexadecimal symbol.
-                // Deny anything else.
-                
-                if (is_hexdigit(c)) {
-                    next_state = current_state;
-                }
-                else if (is_hexsym(c)) {
-                    next_state = 4;
+            case S3:
+                if (get_input_class(lx->input) == ic_eol) {
+                    token->type = t_eol;
+                    token->offset = get_input_offset(lx);
+                    lx->input = get_next_char(lx);
+                    next_state = S0;
                 }
-                else {
-                    next_state = 0;
+                break;
+                
+            case S4:
+                if (get_input_class(lx->input) == ic_eof) {
+                    token->type = t_eof;
+                    token->offset = get_input_offset(lx);
+                    lx->input = get_next_char(lx);
+                    next_state = S0;
                 }
                 break;
                 
-            case 4:
-            
-                // Accept EOS; deny anything else.
+            case S5:
+                if (get_input_class(lx->input) == ic_sqmark) {
+                    capture_lexeme(lx,token);
+                    lx->input = get_next_char(lx);
+                    next_state = S5_1;
+                }
+                break;
                 
-                if (is_eos(c)) {
-                    next_state = 1;
+            case S5_1:
+                switch (get_input_class(lx->input)) {
+                    case ic_sqmark:
+                        capture_lexeme(lx,token);
+                        lx->input = get_next_char(lx);
+                        next_state = S0;
+                        break;
+                    case ic_eol:
+                    case ic_eof:
+                    case ic_comment:
+                        next_state = S0;
+                        break;
+                    default:
+                        capture_lexeme(lx,token);
+                        COUNT(sqstring_bytes,1);
+                        lx->input = get_next_char(lx);
+                        next_state = current_state;
+                        break;
+                }
+                break;
+                
+            case S6:
+                if (get_input_class(lx->input) == ic_dqmark) {
+                    capture_lexeme(lx,token);
+                    lx->input = get_next_char(lx);
+                    next_state = S6_1;
+                }
+                break;
+                
+            case S6_1:
+                switch (get_input_class(lx->input)) {
+                    case ic_dqmark:
+                        capture_lexeme(lx,token);
+                        lx->input = get_next_char(lx);
+                        next_state = S0;
+                        break;
+                    case ic_eol:
+                    case ic_eof:
+                    case ic_comment:
+                        next_state = S0;
+                        break;
+                    default:
+                        capture_lexeme(lx,token);
+                        COUNT(dqstring_bytes,1);
+                        lx->input = get_next_char(lx);
+                        next_state = current_state;
+                        break;
+                }
+                break;
+                
+            case S7:
+                switch (get_input_class(lx->input)) {
+                    case ic_eol:
+                    case ic_eof:
+                        next_state = S1;
+                        break;
+                    default:
+                        skip_to_eol(lx);
+                        next_state = current_state;
+                        break;
+                }
+                break;
+                
+            case S8:
+                // Whitespace, symbols, EOL, EOF, quotation marks and the
+                // comment initiator all end the lexeme; anything else is
+                // part of it.
+                if (get_input_class(lx->input) != ic_other) {
+                    next_state = S0;
+                }
+                else {
+                    capture_lexeme(lx,token);
+                    lx->input = get_next_char(lx);
+                    next_state = current_state;
+                }
+                break;
+
+            // Lexer
+                
+            case S0:
+            
+                done = true;
+                lexeme = lx->buf + (token->offset - lx->base);
+                len = token->length;
+                COUNT(source_bytes,get_input_offset(lx) - start);
+                COUNT(lexeme_bytes,len);
+                
+                if (token->type != t_unknown) {
+                    // Already typed by the tokenizer
+                }
+                else {
+                    token->type = classify_lexeme(lexeme,len,&value);
+                    if (token->type == t_int) {
+                        if (value > WORD_MAX) {
+                            lexer_error(lx,token->offset,"Integer %.*s does not fit in a 16-bit word",(int)len,lexeme);
+                            value &= WORD_MAX;
+                        }
+                        token->intval = value;
+                    }
+                    else if (token->type == t_id) {
+                        token->hash = hash_name(lexeme,len);
+                        if (lx->intern) {
+                            token->id = intern_name(&lx->names,lexeme,len,token->hash);
+                        }
+                    }
+                }
+                COUNT(tokens[token->type],1);
+                TRACE_EVENT(te_token,token->type,token->offset,token->length,token->type == t_id ? token->id : token->intval);
+                break;
+        }
+    }
+}
+
+// TOKEN OPERATIONS
+
+// Create new token
+
+struct token *create_token(struct lexer *lx)
+{
+    struct token *p;
+    p = arena_alloc(&lx->arena,sizeof(struct token));
+    init_token(p);
+    return p;
+}
+
+// Initialize token
+
+void init_token(struct token *p)
+{
+    p->type = t_unknown;
+    p->intval = 0;
+    p->offset = 0;
+    p->length = 0;
+    p->hash = 0;
+    p->id = 0;
+}
+
+// Capture input character into lexeme
+
+void capture_lexeme(struct lexer *lx, struct token *p)
+{
+    // A lexeme is a slice of the source text. Captured characters are always
+    // contiguous, so capturing only records where the slice starts and grows
+    // its length by one.
+
+    if (p->length == 0) {
+        p->offset = get_input_offset(lx);
+        lx->mark = lx->pos - 1;
+    }
+    p->length++;
+}
+
+// Get copy of lexeme
+
+char *get_lexeme(struct lexer *lx, const struct token *p)
+{
+    return arena_substr(&lx->arena,lx->buf+(p->offset-lx->base),p->length);
+}
+
+// Get copy of string value
+
+char *get_strval(struct lexer *lx, const struct token *p)
+{
+    if (p->type == t_squote) {
+        return eval_sqstr(&lx->arena,lx->buf+(p->offset-lx->base),p->length);
+    }
+    else if (p->type == t_dquote) {
+        return eval_dqstr(&lx->arena,lx->buf+(p->offset-lx->base),p->length);
+    }
+    return NULL;
+}
+
+// SCANNERS
+
+// Scanners search a run of source text for the end of a comment or of a
+// whitespace run. Comment bodies and indentation make up much of a typical
+// listing, so the vector versions look at 16 or 32 characters per step.
+
+// Find end of line
+
+const char *find_eol_scalar(const char *p, const char *end)
+{
+    // Return the position of the next EOL, or the end of the text
+    const char *q;
+    q = memchr(p,'\n',end-p);
+    return q ? q : end;
+}
+
+// Skip whitespace
+
+const char *skip_blanks_scalar(const char *p, const char *end)
+{
+    // Return the position of the first character that is not whitespace
+    while (p < end && input_classes[(unsigned char)*p + 1] == ic_whitespace) {
+        p++;
+    }
+    return p;
+}
+
+// Index newlines
+
+void scan_newlines_scalar(struct line_index *ix, const char *p, const char *end, size_t offset)
+{
+    // Append the offset of every newline between p and end; p is at the
+    // given offset in the source text.
+    const char *start = p;
+
+    while ((p = memchr(p,'\n',end-p)) != NULL) {
+        if (ix->count == ix->size) {
+            grow_lines(ix);
+        }
+        ix->eols[ix->count++] = offset + (p - start);
+        p++;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Find end of line with SSE2
+
+__attribute__((target("sse2")))
+const char *find_eol_sse2(const char *p, const char *end)
+{
+    __m128i x;  // sixteen characters
+    int mask;   // EOL lanes
+
+    while (end - p >= 16) {
+        x = _mm_loadu_si128((const __m128i *)p);
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x,_mm_set1_epi8('\n')));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return find_eol_scalar(p,end);
+}
+
+// Find end of line with AVX2
+
+__attribute__((target("avx2")))
+const char *find_eol_avx2(const char *p, const char *end)
+{
+    __m256i x;      // thirty-two characters
+    unsigned mask;  // EOL lanes
+
+    while (end - p >= 32) {
+        x = _mm256_loadu_si256((const __m256i *)p);
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x,_mm256_set1_epi8('\n')));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return find_eol_sse2(p,end);
+}
+
+// Index newlines with SSE2
+
+__attribute__((target("sse2")))
+void scan_newlines_sse2(struct line_index *ix, const char *p, const char *end, size_t offset)
+{
+    // Each block of sixteen characters gives a mask of its newlines; the
+    // set bits are peeled off lowest first.
+
+    const char *start = p;
+    unsigned mask; // EOL lanes
+
+    while (end - p >= 16) {
+        if (ix->size - ix->count < 16) {
+            grow_lines(ix);
+        }
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p),_mm_set1_epi8('\n')));
+        while (mask) {
+            ix->eols[ix->count++] = offset + (p - start) + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+    scan_newlines_scalar(ix,p,end,offset + (p - start));
+}
+
+// Index newlines with AVX2
+
+__attribute__((target("avx2")))
+void scan_newlines_avx2(struct line_index *ix, const char *p, const char *end, size_t offset)
+{
+    const char *start = p;
+    unsigned mask; // EOL lanes
+
+    while (end - p >= 32) {
+        if (ix->size - ix->count < 32) {
+            grow_lines(ix);
+        }
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p),_mm256_set1_epi8('\n')));
+        while (mask) {
+            ix->eols[ix->count++] = offset + (p - start) + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+        p += 32;
+    }
+    scan_newlines_sse2(ix,p,end,offset + (p - start));
+}
+
+// Mark whitespace characters of vector
+
+__attribute__((target("sse2")))
+static inline int sse2_blanks(__m128i x)
+{
+    __m128i blank; // whitespace lanes
+
+    blank = _mm_or_si128(_mm_cmpeq_epi8(x,_mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(x,_mm_set1_epi8('\t')));
+    blank = _mm_or_si128(blank,_mm_cmpeq_epi8(x,_mm_set1_epi8('\v')));
+    blank = _mm_or_si128(blank,_mm_cmpeq_epi8(x,_mm_set1_epi8('\r')));
+    return _mm_movemask_epi8(blank);
+}
+
+// Skip whitespace with SSE2
+
+__attribute__((target("sse2")))
+const char *skip_blanks_sse2(const char *p, const char *end)
+{
+    int mask; // lanes that are not whitespace
+
+    // Most runs are a single space or a short indent; settle those
+    // without touching vector registers.
+    if (p < end && input_classes[(unsigned char)*p + 1] != ic_whitespace) {
+        return p;
+    }
+
+    while (end - p >= 16) {
+        mask = ~sse2_blanks(_mm_loadu_si128((const __m128i *)p)) & 0xFFFF;
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return skip_blanks_scalar(p,end);
+}
+
+// Skip whitespace with AVX2
+
+__attribute__((target("avx2")))
+const char *skip_blanks_avx2(const char *p, const char *end)
+{
+    __m256i x;      // thirty-two characters
+    __m256i blank;  // whitespace lanes
+    unsigned mask;  // lanes that are not whitespace
+
+    // Most runs are a single space or a short indent; settle those
+    // without touching vector registers.
+    if (p < end && input_classes[(unsigned char)*p + 1] != ic_whitespace) {
+        return p;
+    }
+
+    while (end - p >= 32) {
+        x = _mm256_loadu_si256((const __m256i *)p);
+        blank = _mm256_or_si256(_mm256_cmpeq_epi8(x,_mm256_set1_epi8(' ')),
+                                _mm256_cmpeq_epi8(x,_mm256_set1_epi8('\t')));
+        blank = _mm256_or_si256(blank,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('\v')));
+        blank = _mm256_or_si256(blank,_mm256_cmpeq_epi8(x,_mm256_set1_epi8('\r')));
+        mask = ~(unsigned)_mm256_movemask_epi8(blank);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return skip_blanks_sse2(p,end);
+}
+
+#endif
+
+// CLASSIFIER
+
+// Character classes seen by the classifier
+
+typedef enum char_class {
+    cc_other,       // invisible or non-ASCII character
+    cc_bindigit,    // 0 1
+    cc_octdigit,    // 2 to 7
+    cc_decdigit,    // 8 9
+    cc_hexletter,   // a c e f, in either case
+    cc_b,           // binary symbol, also a hex digit
+    cc_d,           // decimal symbol, also a hex digit
+    cc_o,           // octal symbol
+    cc_h,           // hexadecimal symbol
+    cc_letter,      // any other letter
+    cc_underscore,  // _
+    cc_colon,       // :
+    cc_sqmark,      // '
+    cc_dqmark,      // "
+    cc_visible,     // any other visible ASCII character
+    cc_count
+} char_class;
+
+const unsigned char lexeme_class[256] = {
+    [' ' ... '!'] = cc_visible,
+    ['"'] = cc_dqmark,
+    ['#' ... '&'] = cc_visible,
+    ['\''] = cc_sqmark,
+    ['(' ... '/'] = cc_visible,
+    ['0' ... '1'] = cc_bindigit,
+    ['2' ... '7'] = cc_octdigit,
+    ['8' ... '9'] = cc_decdigit,
+    [':'] = cc_colon,
+    [';' ... '@'] = cc_visible,
+    ['A'] = cc_hexletter, ['a'] = cc_hexletter,
+    ['B'] = cc_b, ['b'] = cc_b,
+    ['C'] = cc_hexletter, ['c'] = cc_hexletter,
+    ['D'] = cc_d, ['d'] = cc_d,
+    ['E' ... 'F'] = cc_hexletter, ['e' ... 'f'] = cc_hexletter,
+    ['G'] = cc_letter, ['g'] = cc_letter,
+    ['H'] = cc_h, ['h'] = cc_h,
+    ['I' ... 'N'] = cc_letter, ['i' ... 'n'] = cc_letter,
+    ['O'] = cc_o, ['o'] = cc_o,
+    ['P' ... 'Z'] = cc_letter, ['p' ... 'z'] = cc_letter,
+    ['[' ... '^'] = cc_visible,
+    ['_'] = cc_underscore,
+    ['`'] = cc_visible,
+    ['{' ... '~'] = cc_visible
+};
+
+// Classifier states
+
+typedef enum class_state {
+    ds_dead,        // no token type can match any more
+    ds_start,       // nothing seen yet
+    ds_colon,       // :
+    ds_bin,         // binary digits; a decimal without its symbol
+    ds_oct,         // octal digits; a decimal without its symbol
+    ds_dec,         // decimal digits; a decimal without its symbol
+    ds_hex,         // hex digits after a leading digit
+    ds_binsym,      // binary numeral; may still grow into a hex numeral
+    ds_decsym,      // decimal numeral; may still grow into a hex numeral
+    ds_octsym,      // octal numeral
+    ds_hexsym,      // hexadecimal numeral
+    ds_idhex,       // identifier made of hex digits only
+    ds_idhexsym,    // hexadecimal numeral that is also a valid identifier
+    ds_id,          // identifier
+    ds_sq,          // inside single-quote string
+    ds_sqend,       // single-quote string
+    ds_dq,          // inside double-quote string
+    ds_dqend,       // double-quote string
+    ds_count
+} class_state;
+
+// Transition table. Unlisted transitions lead to the dead state.
+
+#define HEXDIGIT_TO(s) \
+    [cc_bindigit] = s, [cc_octdigit] = s, [cc_decdigit] = s, \
+    [cc_hexletter] = s, [cc_b] = s, [cc_d] = s
+
+#define IDCHAR_TO(s) \
+    HEXDIGIT_TO(s), [cc_o] = s, [cc_h] = s, [cc_letter] = s, [cc_underscore] = s
+
+#define UNQUOTED_TO(s) \
+    IDCHAR_TO(s), [cc_colon] = s, [cc_visible] = s
+
+const unsigned char class_transition[ds_count][cc_count] = {
+    [ds_start] = {
+        [cc_bindigit] = ds_bin, [cc_octdigit] = ds_oct, [cc_decdigit] = ds_dec,
+        [cc_hexletter] = ds_idhex, [cc_b] = ds_idhex, [cc_d] = ds_idhex,
+        [cc_o] = ds_id, [cc_h] = ds_id, [cc_letter] = ds_id, [cc_underscore] = ds_id,
+        [cc_colon] = ds_colon, [cc_sqmark] = ds_sq, [cc_dqmark] = ds_dq
+    },
+    [ds_bin] = {
+        [cc_bindigit] = ds_bin, [cc_octdigit] = ds_oct, [cc_decdigit] = ds_dec,
+        [cc_hexletter] = ds_hex, [cc_b] = ds_binsym, [cc_d] = ds_decsym,
+        [cc_o] = ds_octsym, [cc_h] = ds_hexsym
+    },
+    [ds_oct] = {
+        [cc_bindigit] = ds_oct, [cc_octdigit] = ds_oct, [cc_decdigit] = ds_dec,
+        [cc_hexletter] = ds_hex, [cc_b] = ds_hex, [cc_d] = ds_decsym,
+        [cc_o] = ds_octsym, [cc_h] = ds_hexsym
+    },
+    [ds_dec] = {
+        [cc_bindigit] = ds_dec, [cc_octdigit] = ds_dec, [cc_decdigit] = ds_dec,
+        [cc_hexletter] = ds_hex, [cc_b] = ds_hex, [cc_d] = ds_decsym,
+        [cc_h] = ds_hexsym
+    },
+    [ds_hex] = { HEXDIGIT_TO(ds_hex), [cc_h] = ds_hexsym },
+    [ds_binsym] = { HEXDIGIT_TO(ds_hex), [cc_h] = ds_hexsym },
+    [ds_decsym] = { HEXDIGIT_TO(ds_hex), [cc_h] = ds_hexsym },
+    [ds_idhex] = {
+        HEXDIGIT_TO(ds_idhex), [cc_h] = ds_idhexsym,
+        [cc_o] = ds_id, [cc_letter] = ds_id, [cc_underscore] = ds_id
+    },
+    [ds_idhexsym] = { IDCHAR_TO(ds_id) },
+    [ds_id] = { IDCHAR_TO(ds_id) },
+    [ds_sq] = { UNQUOTED_TO(ds_sq), [cc_dqmark] = ds_sq, [cc_sqmark] = ds_sqend },
+    [ds_dq] = { UNQUOTED_TO(ds_dq), [cc_sqmark] = ds_dq, [cc_dqmark] = ds_dqend }
+};
+
+#undef HEXDIGIT_TO
+#undef IDCHAR_TO
+#undef UNQUOTED_TO
+
+// Token type of each state once the lexeme has been consumed
+
+const token_type class_accept[ds_count] = {
+    [ds_dead]       = t_unknown,
+    [ds_start]      = t_unknown,
+    [ds_colon]      = t_colon,
+    [ds_bin]        = t_int,
+    [ds_oct]        = t_int,
+    [ds_dec]        = t_int,
+    [ds_hex]        = t_unknown,
+    [ds_binsym]     = t_int,
+    [ds_decsym]     = t_int,
+    [ds_octsym]     = t_int,
+    [ds_hexsym]     = t_int,
+    [ds_idhex]      = t_id,
+    [ds_idhexsym]   = t_int,
+    [ds_id]         = t_id,
+    [ds_sq]         = t_unknown,
+    [ds_sqend]      = t_squote,
+    [ds_dq]         = t_unknown,
+    [ds_dqend]      = t_dquote
+};
+
+// Value of every digit character; anything else maps to NOT_A_DIGIT
+
+#define NOT_A_DIGIT 0xFF
+
+const unsigned char digit_values[256] = {
+    [0 ... '/'] = NOT_A_DIGIT,
+    ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+    ['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+    [':' ... '@'] = NOT_A_DIGIT,
+    ['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15,
+    ['G' ... '`'] = NOT_A_DIGIT,
+    ['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+    ['g' ... 255] = NOT_A_DIGIT
+};
+
+// Classify lexeme
+
+token_type classify_lexeme(const char *s, size_t len, int *value)
+{
+    // Determine the token type of a lexeme in a single pass. This is the
+    // union of the recognizers below, tried in the same order of precedence
+    // (colon, binary, octal, decimal, hexadecimal, identifier, single-quote
+    // string, double-quote string), folded into one table-driven DFA. Each
+    // state tracks every token type the lexeme can still turn out to be, so
+    // no character is examined twice.
+    //
+    // An integer's base is given away by its last character, so the value
+    // is accumulated while the digits are scanned. Values too large for a
+    // target word saturate at WORD_MAX + 1 for the caller to report.
+
+    class_state state; // classifier state
+    unsigned int v;    // accumulated value
+    int base;          // base implied by last character
+    size_t ndigits;    // number of characters before the base symbol
+    size_t i;          // index
+    int c;             // current character
+
+    COUNT(calls[rc_classify],1);
+    base = 0;
+    ndigits = 0;
+    if (len > 0) {
+        switch (lexeme_class[(unsigned char)s[len-1]]) {
+            case cc_bindigit:
+            case cc_octdigit:
+            case cc_decdigit:
+                base = 10;
+                ndigits = len;
+                break;
+            case cc_b:
+                base = 2;
+                ndigits = len - 1;
+                break;
+            case cc_o:
+                base = 8;
+                ndigits = len - 1;
+                break;
+            case cc_d:
+                base = 10;
+                ndigits = len - 1;
+                break;
+            case cc_h:
+                base = 16;
+                ndigits = len - 1;
+                break;
+        }
+    }
+
+    // Long runs of digits, as found in data tables, are validated and
+    // converted several characters at a time. A lexeme starting with a digit
+    // whose digits are all valid in the base implied by its last character
+    // can only be an integer. Anything else falls through to the DFA.
+
+    if (ndigits >= 8 && (char_flags[(unsigned char)s[0]] & cf_decdigit)) {
+        v = 0;
+        if (parse_digits(s,ndigits,base,&v) == ndigits) {
+            *value = v;
+            return t_int;
+        }
+    }
+
+    state = ds_start;
+    v = 0;
+    for (i=0; i<ndigits && state != ds_dead; i++) {
+        c = (unsigned char)s[i];
+        state = class_transition[state][lexeme_class[c]];
+        v = v * base + digit_values[c];
+        if (v > WORD_MAX) {
+            v = WORD_MAX + 1;
+        }
+    }
+    for (; i<len && state != ds_dead; i++) {
+        state = class_transition[state][lexeme_class[(unsigned char)s[i]]];
+    }
+
+    *value = (class_accept[state] == t_int) ? (int)v : 0;
+    return class_accept[state];
+}
+
+// DIGIT PARSERS
+
+// Each parser consumes the leading digits of a string that are valid in the
+// given base and returns how many it consumed. The value of those digits is
+// accumulated onto *value, saturating at WORD_MAX + 1 like eval() does.
+
+// Parse digits one at a time
+
+size_t parse_digits_scalar(const char *s, size_t len, int base, unsigned int *value)
+{
+    unsigned int v; // accumulated value
+    size_t i;       // index
+    int d;          // value of current digit
+
+    v = *value;
+    for (i=0; i<len; i++) {
+        d = digit_values[(unsigned char)s[i]];
+        if (d >= base) {
+            break;
+        }
+        v = v * base + d;
+        if (v > WORD_MAX) {
+            v = WORD_MAX + 1;
+        }
+    }
+    *value = v;
+    return i;
+}
+
+// SWAR helpers. A 64-bit word holds eight characters, the first character
+// in the lowest byte.
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH 0x8080808080808080ULL
+
+// Mark bytes of word within a character range
+
+static inline uint64_t swar_in_range(uint64_t x, int lo, int hi)
+{
+    // Bytes must be below 0x80 so that the additions never carry into the
+    // next byte. The high bit of each byte is left set where lo <= c <= hi.
+
+    uint64_t ge_lo; // bytes >= lo
+    uint64_t gt_hi; // bytes > hi
+
+    ge_lo = (x + SWAR_ONES * (0x80 - lo)) & SWAR_HIGH;
+    gt_hi = (x + SWAR_ONES * (0x7F - hi)) & SWAR_HIGH;
+    return ge_lo & ~gt_hi;
+}
+
+// Mark bytes of word that are digits of base
+
+static inline uint64_t swar_digits(uint64_t x, int base)
+{
+    uint64_t ascii; // bytes below 0x80
+    uint64_t mask;  // digit bytes
+
+    ascii = ~x & SWAR_HIGH;
+    x &= ~SWAR_HIGH;
+
+    switch (base) {
+        case 2:
+            mask = swar_in_range(x,'0','1');
+            break;
+        case 8:
+            mask = swar_in_range(x,'0','7');
+            break;
+        case 10:
+            mask = swar_in_range(x,'0','9');
+            break;
+        default:
+            mask = swar_in_range(x,'0','9') | swar_in_range(x | SWAR_ONES * 0x20,'a','f');
+            break;
+    }
+    return mask & ascii;
+}
+
+// Convert word of eight digits to its value
+
+static inline uint32_t swar_convert(uint64_t x, int base)
+{
+    // Turn characters into digit values, then combine neighbouring digits
+    // into pairs, pairs into quads and quads into the full value. No step
+    // can carry out of its lane, even in base 16.
+
+    uint64_t b2; // base squared
+    uint64_t b4; // base to the fourth
+
+    if (base == 16) {
+        x = (x & SWAR_ONES * 0x0F) + 9 * ((x >> 6) & SWAR_ONES);
+    }
+    else {
+        x -= SWAR_ONES * '0';
+    }
+
+    b2 = base * base;
+    b4 = b2 * b2;
+    x = (x * base + (x >> 8)) & 0x00FF00FF00FF00FFULL;
+    x = (x * b2 + (x >> 16)) & 0x0000FFFF0000FFFFULL;
+    x = (x * b4 + (x >> 32)) & 0x00000000FFFFFFFFULL;
+    return x;
+}
+
+// Add value of eight-digit block to accumulated value
+
+static inline void add_digit_block(unsigned int *value, uint32_t block, int base)
+{
+    uint64_t b8; // base to the eighth
+    uint64_t v;  // accumulated value
+
+    b8 = (uint64_t)base * base * base * base;
+    b8 *= b8;
+    v = *value * b8 + block;
+    if (v > WORD_MAX) {
+        v = WORD_MAX + 1;
+    }
+    *value = v;
+}
+
+// Parse digits eight at a time within a general-purpose register
+
+size_t parse_digits_swar(const char *s, size_t len, int base, unsigned int *value)
+{
+    uint64_t x; // eight characters
+    size_t i;   // index
+
+    i = 0;
+    while (len - i >= 8) {
+        memcpy(&x,s+i,8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+        if (swar_digits(x,base) != SWAR_HIGH) {
+            break;
+        }
+        add_digit_block(value,swar_convert(x,base),base);
+        i += 8;
+    }
+    return i + parse_digits_scalar(s+i,len-i,base,value);
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Mark characters of vector that are digits of base
+
+__attribute__((target("sse2")))
+static inline int sse2_digits(__m128i x, int base)
+{
+    __m128i lower;  // characters folded to lowercase
+    __m128i digits; // digit lanes
+
+    digits = _mm_and_si128(_mm_cmpgt_epi8(x,_mm_set1_epi8('0' - 1)),
+                           _mm_cmplt_epi8(x,_mm_set1_epi8('0' + (base < 10 ? base : 10))));
+    if (base == 16) {
+        lower = _mm_or_si128(x,_mm_set1_epi8(0x20));
+        digits = _mm_or_si128(digits,
+                              _mm_and_si128(_mm_cmpgt_epi8(lower,_mm_set1_epi8('a' - 1)),
+                                            _mm_cmplt_epi8(lower,_mm_set1_epi8('f' + 1))));
+    }
+    return _mm_movemask_epi8(digits);
+}
+
+// Convert vector of sixteen binary digits to its value
+
+__attribute__((target("sse2")))
+static inline uint32_t sse2_convert_bin(__m128i x)
+{
+    // Shifting each digit's low bit into its sign bit lets movemask gather
+    // all sixteen bits at once, first digit lowest. Reverse them so the
+    // first digit is the most significant.
+
+    uint32_t v;
+
+    v = _mm_movemask_epi8(_mm_slli_epi64(x,7));
+    v = ((v >> 1) & 0x5555) | ((v & 0x5555) << 1);
+    v = ((v >> 2) & 0x3333) | ((v & 0x3333) << 2);
+    v = ((v >> 4) & 0x0F0F) | ((v & 0x0F0F) << 4);
+    v = ((v >> 8) & 0x00FF) | ((v & 0x00FF) << 8);
+    return v;
+}
+
+// Add value of sixteen-digit binary block to accumulated value
+
+static inline void add_bin_block(unsigned int *value, uint32_t block)
+{
+    uint64_t v; // accumulated value
+
+    v = ((uint64_t)*value << 16) | block;
+    if (v > WORD_MAX) {
+        v = WORD_MAX + 1;
+    }
+    *value = v;
+}
+
+// Parse digits sixteen at a time with SSE2
+
+__attribute__((target("sse2")))
+size_t parse_digits_sse2(const char *s, size_t len, int base, unsigned int *value)
+{
+    // Validate sixteen characters with one set of vector compares. Binary
+    // digits convert straight out of a movemask; other bases convert the
+    // two halves with the SWAR converter.
+
+    __m128i x;      // sixteen characters
+    uint64_t w[2];  // halves of x
+    size_t i;       // index
+
+    i = 0;
+    while (len - i >= 16) {
+        x = _mm_loadu_si128((const __m128i *)(s+i));
+        if (sse2_digits(x,base) != 0xFFFF) {
+            break;
+        }
+        if (base == 2) {
+            add_bin_block(value,sse2_convert_bin(x));
+        }
+        else {
+            _mm_storeu_si128((__m128i *)w,x);
+            add_digit_block(value,swar_convert(w[0],base),base);
+            add_digit_block(value,swar_convert(w[1],base),base);
+        }
+        i += 16;
+    }
+    return i + parse_digits_swar(s+i,len-i,base,value);
+}
+
+// Parse digits sixteen at a time on SSSE3 CPUs
+
+__attribute__((target("ssse3")))
+size_t parse_digits_ssse3(const char *s, size_t len, int base, unsigned int *value)
+{
+    // Validate as the SSE2 parser does, but convert in vector registers
+    // with the multiply-adds pmaddubsw (SSSE3) and pmaddwd (SSE2): digits
+    // are combined into pairs, then pairs into quads, leaving four 4-digit
+    // values for the scalar unit to join. Literals that fit a 16-bit word
+    // are never more than about sixteen digits long, so 256-bit vectors
+    // would only add work.
+
+    __m128i x;      // sixteen characters
+    __m128i pairs;  // eight 2-digit values
+    __m128i quads;  // four 4-digit values
+    uint32_t q[4];  // quads
+    uint32_t b4;    // base to the fourth
+    size_t i;       // index
+
+    b4 = base * base * base * base;
+    i = 0;
+    while (len - i >= 16) {
+        x = _mm_loadu_si128((const __m128i *)(s+i));
+        if (sse2_digits(x,base) != 0xFFFF) {
+            break;
+        }
+        if (base == 2) {
+            add_bin_block(value,sse2_convert_bin(x));
+        }
+        else {
+            if (base == 16) {
+                x = _mm_add_epi8(_mm_and_si128(x,_mm_set1_epi8(0x0F)),
+                                 _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(x,6),_mm_set1_epi8(1)),
+                                                 _mm_set1_epi16(9)));
+            }
+            else {
+                x = _mm_sub_epi8(x,_mm_set1_epi8('0'));
+            }
+            pairs = _mm_maddubs_epi16(x,_mm_set1_epi16((1 << 8) | base));
+            quads = _mm_madd_epi16(pairs,_mm_set1_epi32((1 << 16) | (base * base)));
+            _mm_storeu_si128((__m128i *)q,quads);
+            add_digit_block(value,q[0] * b4 + q[1],base);
+            add_digit_block(value,q[2] * b4 + q[3],base);
+        }
+        i += 16;
+    }
+    return i + parse_digits_swar(s+i,len-i,base,value);
+}
+
+#endif
+
+// EVALUATORS
+
+// Evaluate binary
+
+int eval_bin(const char *s, size_t len)
+{
+    // Evaluate a binary number, leaving out the appended symbol
+    return eval(s,len-1,2);
+}
+
+// Evaluate octal
+
+int eval_oct(const char *s, size_t len)
+{   
+    return eval(s,len-1,8);
+}
+
+// Evaluate decimal
+
+int eval_dec(const char *s, size_t len)
+{
+    // Evaluate a decimal. Unlike other number systems, decimals are valid
+    // with or without the appended symbol. Check for the symbol and leave
+    // it out if necessary before evaluating the decimal.
+
+    if (is_decsym(s[len-1])) {
+        len--;
+    }
+    return eval(s,len,10);
+}
+
+// Evaluate hexadecimal
+
+int eval_hex(const char *s, size_t len)
+{
+    return eval(s,len-1,16);
+}
+
+// Evaluator
+
+int eval(const char *s, size_t len, int base)
+{
+    size_t i;    // loop counter
+    int integer; // stores converted integer
+    
+    // Convert the given digits to an integer value. Working from the most
+    // significant digit down, shift the value so far up by one place and
+    // add the value of the current digit. Values too large for a target
+    // word saturate at WORD_MAX + 1.
+
+    integer = 0;
+    for (i=0; i<len; i++) {
+        integer = integer * base + get_value(s[i]);
+        if (integer > WORD_MAX) {
+            integer = WORD_MAX + 1;
+        }
+    }
+    return integer;
+}
+
+// Lookup digit value
+
+int get_value(int c)
+{
+    // Get the digit value of any digit from the digit value table. Return
+    // an indicator if the character is not a digit.
+
+    int val;
+
+    val = digit_values[(unsigned char)c];
+    if (val == NOT_A_DIGIT) {
+        return -1;
+    }
+    return val;
+}
+
+// Evaluate single-quote string
+
+char *eval_sqstr(struct arena *a, const char *s, size_t len)
+{
+    // This assembler features simple string syntax. So, only remove the quotation marks.
+
+    char *p;
+    p = arena_substr(a,s+1,len-2);
+    return p;
+}
+
+// Evaluate double-quote string
+
+char *eval_dqstr(struct arena *a, const char *s, size_t len)
+{
+    return eval_sqstr(a,s,len);
+}
+
+// TERMINAL RECOGNIZER
+
+// Match token to terminal
+
+bool is_terminal(const char *terminal, const char *s, size_t len)
+{
+    if (strlen(terminal) == len && memcmp(terminal,s,len) == 0) {
+        return true;
+    }
+    return false;
+}
+
+// LOW-LEVEL RECOGNIZERS
+
+// Recognize identifier
+
+bool is_id(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_id],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) { 
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+                
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+                
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+            
+                // Accept either a letter or an underscore; deny anything else.
+                
+                if (char_flags[c] & (cf_letter | cf_underscore)) {
+                    next_state = 3;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept zero or more letters, digits or underscore characters;
+                // deny anything else.
+                
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else if (char_flags[c] & (cf_letter | cf_decdigit | cf_underscore)) {
+                    next_state = current_state;
+                }
+                else {
+                    next_state = 0;
+                }
+                break; 
+        }
+    }
+    return validity;
+}
+
+// Recognize any integer representation
+
+bool is_int(const char *s, size_t len)
+{
+    COUNT(calls[rc_int],1);
+    if (is_bin(s,len) || is_oct(s,len) || is_dec(s,len) || is_hex(s,len)) { 
+        return true;
+    }
+    return false;
+}
+
+// Recognize binary numeral
+
+bool is_bin(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_bin],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) { 
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+                
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+                
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+            
+                // Accept one binary digit. Deny anything else
+                
+                if (char_flags[c] & cf_bindigit) {
+                    next_state = 3;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept zero or more binary digits. Deny anything else.
+                
+                if (char_flags[c] & cf_bindigit) {
+                    next_state = current_state;
+                }
+                else if (is_binsym(c)) {
+                    next_state = 4;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 4:
+            
+                // Accept EOS; deny anything else.
+                
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+        }
+    }
+    
+    return validity;
+}
+
+// Recognize octal numeral
+
+bool is_oct(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_oct],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) {
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+                
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+                
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+            
+                // Accept one octal digit; deny anything else.
+                
+                if (char_flags[c] & cf_octdigit) {
+                    next_state = 3;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept zero or more octal digits; deny anything else.
+                
+                if (char_flags[c] & cf_octdigit) {
+                    next_state = current_state;
+                }
+                else if (is_octsym(c)) {
+                    next_state = 4;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 4:
+            
+                // Accept EOS; deny anything else.
+                
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+        }
+    }
+    return validity;
+}
+
+// Recognize decimal numeral
+
+bool is_dec(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_dec],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) { 
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+                
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+            
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+                
+                // Accept one decimal digit; deny anything else.
+            
+                if (char_flags[c] & cf_decdigit) {
+                    next_state = 3;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept zero or more decimal digits; deny anything else.
+            
+                if (char_flags[c] & cf_decdigit) {
+                    next_state = current_state;
+                }
+                else if (is_decsym(c)) {
+                    next_state = 4;
+                }
+                else if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 4:
+            
+                // Accept EOS; deny anything else.
+                
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+        }
+    }
+    return validity;
+}
+
+// Recognize hexadecimal numeral
+
+bool is_hex(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_hex],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) { 
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+                
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+                
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+            
+                // Accept one hex digit; deny anything else.
+                
+                if (char_flags[c] & cf_hexdigit) {
+                    next_state = 3;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept zero or more hex digits; or accept hexadecimal symbol.
+                // Deny anything else.
+                
+                if (char_flags[c] & cf_hexdigit) {
+                    next_state = current_state;
+                }
+                else if (is_hexsym(c)) {
+                    next_state = 4;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 4:
+            
+                // Accept EOS; deny anything else.
+                
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+        }
+    }
+    return validity;
+}
+
+// Recognize single-quote string
+
+bool is_sqstr(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_sqstr],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) { 
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+                
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+                
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+            
+                // Accept opening single-quotation mark. Deny anything else.
+                
+                if (is_sqmark(c)) {
+                    next_state = 3;
+                }
+                else {  
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept any visible ASCII character, except for the
+                // single-quotation mark. Or, accept closing single-quotation mark.
+                // Deny anything else.
+                
+                if ((char_flags[c] & cf_visible) && c != '\'') {
+                    next_state = current_state;
+                }
+                else if (is_sqmark(c)) {
+                    next_state = 4;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 4:
+            
+                // Accept EOS; deny anything else.
+                
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {  
+                    next_state = 0;
+                }
+        }
+    }
+    return validity;
+}
+
+// Recognize double-quote string
+
+bool is_dqstr(const char *s, size_t len)
+{
+    int current_state;
+    int next_state;
+    bool validity;
+    bool done;
+    int c;
+    int i;
+    
+    COUNT(calls[rc_dqstr],1);
+    i = 0;
+    done = false;
+    next_state = 2;
+    
+    while (!done) { 
+    
+        c = char_at(s,len,i++);
+        current_state = next_state;
+        
+        switch(current_state) {
+        
+            case 0:
+            
+                // Invalid
+
+                validity = false;
+                done = true;
+                break;
+                
+            case 1:
+            
+                // Valid
+
+                validity = true;
+                done = true;
+                break;
+                
+            case 2:
+            
+                // Accept opening double-quotation mark. Deny all others.
+               
+                if (is_dqmark(c)) {
+                    next_state = 3;
+                }
+                else {  
+                    next_state = 0;
+                }
+                break;
+                
+            case 3:
+            
+                // Accept any visible ASCII character except the double-quotation
+                // mark. Or, accept closing double-quotation mark.
+                // Deny anything else.
+
+                if ((char_flags[c] & cf_visible) && c != '"') {
+                    next_state = current_state;
+                }
+                else if (is_dqmark(c)) {
+                    next_state = 4;
+                }
+                else {
+                    next_state = 0;
+                }
+                break;
+                
+            case 4:
+            
+                // Accept EOS; deny anything else.
+
+                if (is_eos(c)) {
+                    next_state = 1;
+                }
+                else {  
+                    next_state = 0;
+                }
+        }
+    }
+    return validity;
+}
+
+// ATOM RECOGNIZERS 
+
+// Recognize binary digit
+
+bool is_bindigit(int c)
+{
+    return (get_char_flags(c) & cf_bindigit) != 0;
+}
+
+// Recognize octal digit
+
+bool is_octdigit(int c)
+{
+    return (get_char_flags(c) & cf_octdigit) != 0;
+}
+
+// Recognize decimal digit
+
+bool is_decdigit(int c)
+{
+    return (get_char_flags(c) & cf_decdigit) != 0;
+}
+
+// Recognize hexadecimal digit
+
+bool is_hexdigit(int c)
+{
+    return (get_char_flags(c) & cf_hexdigit) != 0;
+}
+
+// Recognize digit
+
+bool is_digit(int c)
+{
+    return (get_char_flags(c) & cf_decdigit) != 0;
+}
+
+// Recognize letter
+
+bool is_letter(int c)
+{
+    return (get_char_flags(c) & cf_letter) != 0;
+}
+
+// Recognize any visible ASCII character
+
+bool is_visible_ascii_character(int c) 
+{
+    return (get_char_flags(c) & cf_visible) != 0;
+}
+
+// MISC RECOGNIZERS
+
+// Recognize end-of-string character
+
+bool is_eos(int c)
+{
+    if (c == '\0') {
+        return true;
+    }
+    return false;
+}
+
+// Recognize end-of-line character
+
+bool is_eol(int c)
+{
+    return get_input_class(c) == ic_eol;
+}
+
+// Recognize end-of-file indicator
+
+bool is_eof(int c)
+{
+    return get_input_class(c) == ic_eof;
+}
+
+// Recognize binary notation symbol
+
+bool is_binsym(int c)
+{
+    if (tolowercase(c) == 'b') {
+        return true;
+    }
+    return false;
+}
+
+// Recognize octal notation symbol
+
+bool is_octsym(int c)
+{
+    if (tolowercase(c) == 'o') {
+        return true;
+    }
+    return false;
+}
+
+// Recognize decimal notation symbol
+
+bool is_decsym(int c)
+{
+    if (tolowercase(c) == 'd') {
+        return true;
+    }
+    return false;
+}
+
+// Recognize hexadecimal notation symbol
+
+bool is_hexsym(int c)
+{
+    if (tolowercase(c) == 'h') {
+        return true;
+    }
+    return false;
+}
+
+// Recognize comment initiator
+
+bool is_comment_initor(int c)
+{
+    return get_input_class(c) == ic_comment;
+}
+
+// Recognize underscore character
+
+bool is_underscore(int c)
+{
+    return (get_char_flags(c) & cf_underscore) != 0;
+}
+
+// Recognize single quotation mark
+
+bool is_sqmark(int c)
+{
+    return get_input_class(c) == ic_sqmark;
+}
+
+// Recognize double quotation mark
+
+bool is_dqmark(int c)
+{
+    return get_input_class(c) == ic_dqmark;
+}
+
+// Recognize a symbol
+
+bool is_symbol(int c)
+{
+    return get_input_class(c) == ic_symbol;
+}
+
+// Recognize whitespace
+
+bool is_whitespace(int c)
+{
+    return get_input_class(c) == ic_whitespace;
+}
+
+// HELPERS
+
+// Convert a lowercase to uppercase
+
+int touppercase(int c)
+{
+    if (c >= 'a' && c <= 'z') {
+        c -= 32;
+    }
+    return c;
+}
+
+// Convert an uppercase to lowercase
+
+int tolowercase(int c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        c += 32;
+    }
+    return c;
+}
+
+// Get substring
+
+char *substr(const char *s, size_t len)
+{
+    char *p;
+    if (len == 0) {
+        p = emalloc(1);
+        strcpy(p,"");
+    }
+    else {
+        p = emalloc(len+1);
+        memcpy(p,s,len);
+        p[len] = '\0'; // add string terminator
+    }
+    return p;
+}
+
+// Get character at index of a string slice
+
+int char_at(const char *s, size_t len, size_t i)
+{
+    // Slices are not terminated, so report the end-of-string character
+    // once the index runs past the end of the slice.
+    if (i < len) {
+        return (unsigned char)s[i];
+    }
+    return '\0';
+}
+
+// Duplicate string
+
+char *dupstr(const char *s)
+{
+    char *p;
+    p = emalloc(strlen(s)+1);
+    strcpy(p,s);
+    return p;
+}
+
+//=============================================================================
+// Tree builder
+//=============================================================================
+
+// Initialize tree
+
+void init_tree(struct tree *t)
+{
+    t->nodes = NULL;
+    t->count = 1;
+    t->size = 0;
+    t->first = 0;
+    t->last = 0;
+    t->text = NULL;
+    t->length = 0;
+    t->capacity = 0;
+    t->code = NULL;
+    t->code_length = 0;
+    t->code_size = 0;
+}
+
+// Release tree
+
+void release_tree(struct tree *t)
+{
+    free(t->nodes);
+    free(t->text);
+    free(t->code);
+    init_tree(t);
+}
+
+// Add node made from token
+
+uint32_t add_node(struct tree *t, node_kind kind, const struct token *token)
+{
+    // The node array doubles as it fills, so building a tree takes a few
+    // dozen allocations however long the source is. Nodes refer to each
+    // other by index and stay valid as the array moves.
+
+    struct node *p; // node added
+
+    if (t->count >= t->size) {
+        if (t->size > UINT32_MAX / 2) {
+            fail("Source text has too many nodes for a tree");
+        }
+        t->size = t->size ? t->size * 2 : 65536;
+        t->nodes = erealloc(t->nodes,t->size * sizeof(struct node));
+    }
+    if (token->offset + token->length > UINT32_MAX) {
+        fail("Source text is too large for a tree");
+    }
+    p = &t->nodes[t->count];
+    p->kind = kind;
+    p->code = 0;
+    p->count = 0;
+    p->child = 0;
+    p->next = 0;
+    p->offset = token->offset;
+    p->length = token->length;
+    p->value = 0;
+    return t->count++;
+}
+
+// Append child to node
+
+void add_child(struct tree *t, uint32_t parent, uint32_t child)
+{
+    // A node has a handful of children at most, so the last one is found
+    // by walking along them.
+
+    uint32_t i; // index of sibling
+
+    if (!t->nodes[parent].child) {
+        t->nodes[parent].child = child;
+    }
+    else {
+        for (i=t->nodes[parent].child; t->nodes[i].next; i=t->nodes[i].next);
+        t->nodes[i].next = child;
+    }
+    t->nodes[parent].count++;
+}
+
+// Add text to tree
+
+uint32_t add_text(struct tree *t, const char *s, size_t len)
+{
+    // Return the offset of the copy in the tree's text
+    size_t start;
+
+    if (t->length + len > t->capacity) {
+        while (t->length + len > t->capacity) {
+            t->capacity = t->capacity ? t->capacity * 2 : 4096;
+        }
+        t->text = erealloc(t->text,t->capacity);
+    }
+    if (t->length + len > INT32_MAX) {
+        fail("Source text has too many strings for a tree");
+    }
+    start = t->length;
+    memcpy(t->text + start,s,len);
+    t->length += len;
+    return start;
+}
+
+// Build tree from tokens
+
+void build_tree(struct tree *t, struct lookahead *la)
+{
+    uint32_t statement; // index of statement
+
+    while (peek_token(la,0)->type != t_eof) {
+        statement = parse_statement(t,la);
+        if (statement) {
+            add_statement(t,statement);
+        }
+    }
+}
+
+// Append statement to tree
+
+void add_statement(struct tree *t, uint32_t statement)
+{
+    if (t->last) {
+        t->nodes[t->last].next = statement;
+    }
+    else {
+        t->first = statement;
+    }
+    t->last = statement;
+}
+
+// Parse statement
+
+uint32_t parse_statement(struct tree *t, struct lookahead *la)
+{
+    // A statement takes up one line:
+    //
+    //     [label ':'] [mnemonic operand... | directive operand...] EOL
+    //
+    // Return the index of the statement node, or 0 if the line is blank or
+    // in error. A line in error is reported and skipped, and whatever was
+    // added to the tree for it is taken out again.
+
+    const struct token *token;     // current token
+    const struct keyword *keyword; // keyword spelled by current token
+    uint32_t statement;            // index of statement node
+    uint32_t operation;            // index of instruction or directive node
+    uint32_t operand;              // index of operand node
+    size_t length;                 // length of tree text before statement
+    uint32_t code_length;          // length of tree code before statement
+
+    token = peek_token(la,0);
+    if (token->type == t_eol) {
+        advance_token(la);
+        return 0;
+    }
+    length = t->length;
+    code_length = t->code_length;
+    statement = add_node(t,n_statement,token);
+
+    // Label
+    if (token->type == t_id && peek_token(la,1)->type == t_colon) {
+        keyword = get_keyword(la,token);
+        if (keyword) {
+            lexer_error(la->lx,token->offset,"Keyword %s cannot be a label",keyword->name);
+            return reject_statement(t,la,statement,length,code_length);
+        }
+        operand = add_node(t,n_label,token);
+        t->nodes[operand].value = token->id;
+        add_child(t,statement,operand);
+        advance_token(la);
+        advance_token(la);
+        token = peek_token(la,0);
+    }
+
+    // Instruction or directive
+    if (token->type == t_id) {
+        keyword = get_keyword(la,token);
+        if (keyword && keyword->kind == kk_mnemonic) {
+            operation = add_node(t,n_instruction,token);
+        }
+        else if (keyword && keyword->kind == kk_directive) {
+            operation = add_node(t,n_directive,token);
+        }
+        else {
+            lexer_error(la->lx,token->offset,"Unknown instruction %s",get_name(&la->lx->names,token->id));
+            return reject_statement(t,la,statement,length,code_length);
+        }
+        t->nodes[operation].code = keyword->code;
+        t->nodes[operation].value = token->id;
+        add_child(t,statement,operation);
+        advance_token(la);
+
+        // Operands
+        while (peek_token(la,0)->type != t_eol && peek_token(la,0)->type != t_eof) {
+            operand = parse_operand(t,la);
+            if (!operand) {
+                return reject_statement(t,la,statement,length,code_length);
+            }
+            add_child(t,operation,operand);
+        }
+    }
+    else if (token->type != t_eol && token->type != t_eof) {
+        lexer_error(la->lx,token->offset,"Expected instruction or directive");
+        return reject_statement(t,la,statement,length,code_length);
+    }
+
+    if (peek_token(la,0)->type == t_eol) {
+        advance_token(la);
+    }
+    return statement;
+}
+
+// Take statement in error out of tree and skip rest of its line
+
+uint32_t reject_statement(struct tree *t, struct lookahead *la, uint32_t statement, size_t length, uint32_t code_length)
+{
+    // The statement's nodes, text and code were the last added, so cutting
+    // the tree back to where they start removes them. Returns 0, for the
+    // caller to return.
+
+    t->count = statement;
+    t->length = length;
+    t->code_length = code_length;
+    skip_line(la);
+    return 0;
+}
+
+// Parse operand
+
+uint32_t parse_operand(struct tree *t, struct lookahead *la)
+{
+    // Return the index of the operand node, or 0 after reporting an
+    // operand in error.
+
+    const struct token *token;     // current token
+    const struct keyword *keyword; // keyword spelled by token
+    struct lexer *lx;              // lexer token came from
+    uint32_t operand;              // index of operand node
+
+    token = peek_token(la,0);
+    lx = la->lx;
+    switch (token->type) {
+        case t_id:
+            keyword = get_keyword(la,token);
+            if (!keyword || keyword->kind != kk_register) {
+                return parse_value(t,la);
+            }
+            operand = add_node(t,n_register,token);
+            t->nodes[operand].code = keyword->code;
+            break;
+
+        case t_squote:
+        case t_dquote:
+            // The string is the token just scanned, so its text is still
+            // there even when the source text is streamed
+            operand = add_node(t,n_string,token);
+            t->nodes[operand].value = add_text(t,lx->buf + (token->offset - lx->base) + 1,token->length - 2);
+            t->nodes[operand].length = token->length - 2;
+            break;
+
+        default:
+            return parse_value(t,la);
+    }
+    advance_token(la);
+    return operand;
+}
+
+// Parse value operand
+
+uint32_t parse_value(struct tree *t, struct lookahead *la)
+{
+    // A value is an expression. Folded down to a constant or a lone label it
+    // becomes an integer or symbol node and its program is dropped, so only
+    // expressions that need labels keep any code. Operands are not
+    // separated, so an operator after a value always continues the
+    // expression: dw 1 -2 is the single word 1-2.
+
+    struct token first; // first token of expression
+    uint32_t start;     // index of program in code
+    uint32_t operand;   // index of operand node
+
+    first = *peek_token(la,0);
+    start = t->code_length;
+    if (!parse_expression(t,la,0,0)) {
+        t->code_length = start;
+        return 0;
+    }
+
+    if (t->code_length - start == 1 && t->code[start].op == o_const) {
+        operand = add_node(t,n_integer,&first);
+        t->nodes[operand].value = t->code[start].value;
+        t->code_length = start;
+    }
+    else if (t->code_length - start == 1 && t->code[start].op == o_label) {
+        operand = add_node(t,n_symbol,&first);
+        t->nodes[operand].value = t->code[start].value;
+        t->code_length = start;
+    }
+    else {
+        operand = add_node(t,n_expression,&first);
+        t->nodes[operand].value = start;
+        t->nodes[operand].length = t->code_length - start;
+    }
+    return operand;
+}
+
+// Binary operators by token type, with their precedence from 1 (loosest)
+// to 6 (tightest); 0 for tokens that are not binary operators
+
+#define BINARY_LEVELS 6
+
+const struct {
+    uint8_t op;         // operator
+    uint8_t precedence; // precedence
+} binary_operators[t_unknown + 1] = {
+    [t_pipe]    = { o_or,  1 },
+    [t_caret]   = { o_xor, 2 },
+    [t_amp]     = { o_and, 3 },
+    [t_shl]     = { o_shl, 4 },
+    [t_shr]     = { o_shr, 4 },
+    [t_plus]    = { o_add, 5 },
+    [t_minus]   = { o_sub, 5 },
+    [t_star]    = { o_mul, 6 },
+    [t_slash]   = { o_div, 6 },
+    [t_percent] = { o_mod, 6 }
+};
+
+// Parse expression
+
+bool parse_expression(struct tree *t, struct lookahead *la, int level, int depth)
+{
+    // Parse operators of the given precedence level and tighter, appending
+    // postfix code to the tree. Each level parses its operands one level
+    // tighter, so operators of a level group from the left.
+
+    const struct token *token; // current token
+    operator op;               // operator of token
+    uint32_t start;            // index of code of left operand
+    uint32_t middle;           // index of code of right operand
+    size_t offset;             // offset of operator
+
+    if (level == BINARY_LEVELS) {
+        return parse_unary(t,la,depth);
+    }
+    start = t->code_length;
+    if (!parse_expression(t,la,level + 1,depth)) {
+        return false;
+    }
+    for (;;) {
+        token = peek_token(la,0);
+        if (binary_operators[token->type].precedence != level + 1) {
+            return true;
+        }
+        op = binary_operators[token->type].op;
+        offset = token->offset;
+        advance_token(la);
+        middle = t->code_length;
+        if (!parse_expression(t,la,level + 1,depth)) {
+            return false;
+        }
+        if (!fold_operation(t,la->lx,op,start,middle,offset)) {
+            return false;
+        }
+    }
+}
+
+// Parse unary expression
+
+bool parse_unary(struct tree *t, struct lookahead *la, int depth)
+{
+    const struct token *token;     // current token
+    const struct keyword *keyword; // keyword spelled by token
+    struct lexer *lx;              // lexer token came from
+    token_type type;               // type of unary operator
+    uint32_t start;                // index of code of operand
+    size_t offset;                 // offset of token
+
+    token = peek_token(la,0);
+    lx = la->lx;
+    offset = token->offset;
+    switch (token->type) {
+        case t_plus:
+        case t_minus:
+        case t_tilde:
+        case t_lparen:
+            if (depth == EXPRESSION_DEPTH) {
+                lexer_error(lx,offset,"Expression is nested too deeply");
+                return false;
+            }
+            type = token->type;
+            advance_token(la);
+            start = t->code_length;
+            if (type == t_lparen) {
+                if (!parse_expression(t,la,0,depth + 1)) {
+                    return false;
+                }
+                token = peek_token(la,0);
+                if (token->type != t_rparen) {
+                    lexer_error(lx,token->offset,"Expected right parenthesis, not %s",get_meaning(token->type));
+                    return false;
+                }
+                advance_token(la);
+                return true;
+            }
+            if (!parse_unary(t,la,depth + 1)) {
+                return false;
+            }
+            if (type == t_plus) {
+                return true;
+            }
+            return fold_operation(t,lx,type == t_minus ? o_neg : o_not,start,start,offset);
+
+        case t_int:
+            add_operation(t,o_const,token->intval);
+            break;
+
+        case t_id:
+            keyword = get_keyword(la,token);
+            if (keyword) {
+                lexer_error(lx,offset,"Keyword %s cannot be a value",keyword->name);
+                return false;
+            }
+            add_operation(t,o_label,token->id);
+            break;
+
+        default:
+            lexer_error(lx,offset,"Expected a value, not %s",get_meaning(token->type));
+            return false;
+    }
+    advance_token(la);
+    return true;
+}
+
+// Append operation to code of tree
+
+void add_operation(struct tree *t, operator op, uint32_t value)
+{
+    if (t->code_length >= t->code_size) {
+        if (t->code_size > UINT32_MAX / 2) {
+            fail("Source text has too many expressions for a tree");
+        }
+        t->code_size = t->code_size ? t->code_size * 2 : 4096;
+        t->code = erealloc(t->code,t->code_size * sizeof(struct operation));
+    }
+    t->code[t->code_length].op = op;
+    t->code[t->code_length].value = value;
+    t->code_length++;
+}
+
+// Apply operator to operands just parsed, folding it if they are constant
+
+bool fold_operation(struct tree *t, struct lexer *lx, operator op, uint32_t start, uint32_t middle, size_t offset)
+{
+    // The code of the left operand runs from start to middle and that of the
+    // right one from middle to the end; a unary operator has no left
+    // operand, so start and middle are the same. An operand whose code is a
+    // single constant is itself constant.
+
+    struct operation *left;  // left operand
+    struct operation *right; // right operand
+    unsigned int result;     // folded value
+
+    left = &t->code[start];
+    right = &t->code[middle];
+    if (t->code_length - middle == 1 && right->op == o_const) {
+        if (start == middle) {
+            apply_operator(op,right->value,0,&result);
+            right->value = result;
+            return true;
+        }
+        if (middle - start == 1 && left->op == o_const) {
+            if (!apply_operator(op,left->value,right->value,&result)) {
+                lexer_error(lx,offset,"Division by zero");
+                return false;
+            }
+            left->value = result;
+            t->code_length = middle;
+            return true;
+        }
+    }
+    add_operation(t,op,0);
+    return true;
+}
+
+// Get keyword spelled by token
+
+const struct keyword *get_keyword(struct lookahead *la, const struct token *token)
+{
+    if (token->type != t_id) {
+        return NULL;
+    }
+    return la->lx->names.names[token->id].keyword;
+}
+
+// Skip rest of line
+
+void skip_line(struct lookahead *la)
+{
+    while (peek_token(la,0)->type != t_eol && peek_token(la,0)->type != t_eof) {
+        advance_token(la);
+    }
+    if (peek_token(la,0)->type == t_eol) {
+        advance_token(la);
+    }
+}
+
+//=============================================================================
+// Instruction set
+//=============================================================================
+
+// Operand formats
+
+#define X(name, operands, registers, word) [f_##name] = { operands, registers, word },
+const struct format formats[f_count] = {
+    FORMATS(X)
+};
+#undef X
+
+// Operand format of each instruction
+
+#define X(name, c0, c1, cl, format) [m_##name] = f_##format,
+const uint8_t instruction_formats[m_count] = {
+    MNEMONICS(X)
+};
+#undef X
+
+// Mnemonic of each instruction
+
+#define X(name, c0, c1, cl, format) [m_##name] = #name,
+const char *mnemonic_names[m_count] = {
+    MNEMONICS(X)
+};
+#undef X
+
+_Static_assert(m_count <= 1 << (16 - OPCODE_SHIFT),"Too many instructions for the opcode field");
+
+// Encode first word of instruction
+
+uint16_t encode_word(mnemonic m, const uint8_t *registers)
+{
+    // The format says how many register fields the instruction has; each
+    // goes in at its shift after the opcode
+    uint16_t word;
+    int i;
+
+    word = m << OPCODE_SHIFT;
+    for (i=0; i<formats[instruction_formats[m]].registers; i++) {
+        word |= (registers[i] & REGISTER_MASK) << REGISTER_SHIFT(i);
+    }
+    return word;
+}
+
+// Decode first word of instruction
+
+bool decode_word(uint16_t word, struct instruction *in)
+{
+    // The word is rejected if its opcode is not an instruction or if it has
+    // bits set outside the fields of its format, so data rarely passes for
+    // code. Whether a second word follows is told by formats[in->format].
+
+    uint16_t used; // bits used by fields of format
+    int i;
+
+    in->mnemonic = word >> OPCODE_SHIFT;
+    if (in->mnemonic >= m_count) {
+        return false;
+    }
+    in->format = instruction_formats[in->mnemonic];
+    used = WORD_MAX & ~((1u << OPCODE_SHIFT) - 1);
+    for (i=0; i<REGISTER_FIELDS; i++) {
+        if (i < formats[in->format].registers) {
+            in->registers[i] = (word >> REGISTER_SHIFT(i)) & REGISTER_MASK;
+            used |= REGISTER_MASK << REGISTER_SHIFT(i);
+        }
+        else {
+            in->registers[i] = 0;
+        }
+    }
+    return (word & ~used) == 0;
+}
+
+//=============================================================================
+// Disassembler
+//=============================================================================
+
+// Disassemble memory image
+
+void disassemble(const char *filename)
+{
+    // List every word of the image with its address. Words that do not
+    // decode are listed as dw; so is an instruction whose second word is
+    // past the end of the image.
+
+    static uint16_t image[MEMORY_WORDS]; // memory image
+    unsigned char b[2];     // bytes of word
+    struct instruction in;  // decoded instruction
+    const struct format *f; // format of instruction
+    FILE *fp;               // image file
+    uint32_t n;             // number of words in image
+    uint32_t i;             // address
+    int j;                  // index of register
+
+    fp = efopen(filename,"rb");
+    for (n=0; n<MEMORY_WORDS && fread(b,1,2,fp) == 2; n++) {
+        image[n] = b[0] | b[1] << 8;
+    }
+    fclose(fp);
+
+    for (i=0; i<n; i++) {
+        if (!decode_word(image[i],&in) || (formats[in.format].word && i + 1 >= n)) {
+            printf("%04x: %04x        dw %05xh\n",i,image[i],image[i]);
+            continue;
+        }
+        f = &formats[in.format];
+        if (f->word) {
+            printf("%04x: %04x %04x   %s",i,image[i],image[i+1],mnemonic_names[in.mnemonic]);
+        }
+        else {
+            printf("%04x: %04x        %s",i,image[i],mnemonic_names[in.mnemonic]);
+        }
+        for (j=0; j<f->registers; j++) {
+            printf(" r%d",in.registers[j]);
+        }
+        if (f->word) {
+            printf(" %05xh",image[++i]);
+        }
+        printf("\n");
+    }
+}
+
+//=============================================================================
+// Code generation
+//=============================================================================
+
+// Initialize assembler
+
+void init_assembler(struct assembler *as, struct lexer *lx, struct tree *t)
+{
+    as->lx = lx;
+    as->tree = t;
+    as->image = emalloc(MEMORY_WORDS * sizeof(uint16_t));
+    memset(as->image,0,MEMORY_WORDS * sizeof(uint16_t));
+    as->loc = 0;
+    as->top = 0;
+    as->full = false;
+    init_symbols(&as->symbols);
+    as->fixups = NULL;
+    as->nfixups = 1;
+    as->fixup_size = 0;
+}
+
+// Release assembler
+
+void release_assembler(struct assembler *as)
+{
+    free(as->image);
+    release_symbols(&as->symbols);
+    free(as->fixups);
+    as->image = NULL;
+    as->fixups = NULL;
+}
+
+// Assemble statement
+
+void assemble_statement(struct assembler *as, uint32_t statement)
+{
+    struct node *nodes; // nodes of tree
+    uint32_t label;     // index of label node, or 0
+    uint32_t i;         // index of operation node, or 0
+    int value;          // value of equ
+
+    nodes = as->tree->nodes;
+    label = 0;
+    i = nodes[statement].child;
+    if (i && nodes[i].kind == n_label) {
+        label = i;
+        i = nodes[i].next;
+    }
+
+    // A label names the address of its line, except on equ, which gives it
+    // a value of its own
+    if (i && nodes[i].kind == n_directive && nodes[i].code == d_equ) {
+        if (!label) {
+            lexer_error(as->lx,nodes[i].offset,"equ needs a label");
+        }
+        else if (nodes[i].count != 1) {
+            lexer_error(as->lx,nodes[i].offset,"equ takes one value");
+        }
+        else if (get_known_value(as,nodes[i].child,&value)) {
+            define_label(as,label,value);
+        }
+        return;
+    }
+    // A ds can leave the location counter past the end of memory, where
+    // no address fits in a word
+    if (label && as->loc >= MEMORY_WORDS) {
+        lexer_error(as->lx,nodes[label].offset,"Location of label %s is out of range",get_name(&as->lx->names,nodes[label].value));
+    }
+    else if (label) {
+        define_label(as,label,as->loc);
+    }
+
+    if (!i) {
+        return;
+    }
+    if (nodes[i].kind == n_instruction) {
+        encode_instruction(as,i);
+    }
+    else {
+        encode_directive(as,i);
+    }
+}
+
+// Encode instruction
+
+void encode_instruction(struct assembler *as, uint32_t i)
+{
+    struct node *nodes;                 // nodes of tree
+    uint8_t registers[REGISTER_FIELDS]; // register operands
+    uint32_t op;                        // index of operand node
+    int n;                              // number of register operands
+
+    nodes = as->tree->nodes;
+    if (!match_operands(nodes,i,instruction_formats[nodes[i].code])) {
+        lexer_error(as->lx,nodes[i].offset,"Wrong operands for %s",get_name(&as->lx->names,nodes[i].value));
+        return;
+    }
+
+    // Registers come first; an immediate or address is the last operand and
+    // goes in the next word
+    n = 0;
+    for (op=nodes[i].child; op && nodes[op].kind == n_register; op=nodes[op].next) {
+        registers[n++] = nodes[op].code;
+    }
+    emit_word(as,encode_word(nodes[i].code,registers),nodes[i].offset);
+    if (op) {
+        emit_operand(as,op);
+    }
+}
+
+// Encode directive
+
+void encode_directive(struct assembler *as, uint32_t i)
+{
+    struct node *nodes; // nodes of tree
+    uint32_t op;        // index of operand node
+    uint32_t j;         // index into string text
+    int value;          // value of operand
+
+    nodes = as->tree->nodes;
+    op = nodes[i].child;
+    switch (nodes[i].code) {
+        case d_org:
+        case d_ds:
+            if (nodes[i].count != 1) {
+                lexer_error(as->lx,nodes[i].offset,"%s takes one value",get_name(&as->lx->names,nodes[i].value));
+                break;
+            }
+            if (!get_known_value(as,op,&value)) {
+                break;
+            }
+            if (nodes[i].code == d_org) {
+                as->loc = value;
+            }
+            else {
+                as->loc += value;
+            }
+            if (as->loc > as->top) {
+                as->top = as->loc < MEMORY_WORDS ? as->loc : MEMORY_WORDS;
+            }
+            break;
+
+        case d_dw:
+            // Each value takes a word; each character of a string does too
+            for (; op; op=nodes[op].next) {
+                if (nodes[op].kind == n_string) {
+                    for (j=0; j<nodes[op].length; j++) {
+                        emit_word(as,(unsigned char)as->tree->text[nodes[op].value + j],nodes[op].offset);
+                    }
+                }
+                else if (nodes[op].kind == n_register) {
+                    lexer_error(as->lx,nodes[op].offset,"dw does not take registers");
+                }
+                else {
+                    emit_operand(as,op);
+                }
+            }
+            break;
+    }
+}
+
+// Check operands of instruction against format
+
+bool match_operands(const struct node *nodes, uint32_t i, operand_format format)
+{
+    const char *k; // operand kind wanted
+    uint32_t op;   // index of operand node
+
+    k = formats[format].operands;
+    for (op=nodes[i].child; op; op=nodes[op].next, k++) {
+        if (*k == 'r' && nodes[op].kind != n_register) {
+            return false;
+        }
+        if (*k == 'v' && nodes[op].kind != n_integer && nodes[op].kind != n_symbol && nodes[op].kind != n_expression) {
+            return false;
+        }
+        if (*k == '\0') {
+            return false;
+        }
+    }
+    return *k == '\0';
+}
+
+// Get symbol of identifier
+
+struct symbol *get_symbol(struct assembler *as, int id)
+{
+    // The symbol is added, undefined, the first time the label turns up.
+    // The pointer is good until the next symbol is added.
+
+    uint32_t hash;     // hash of identifier
+    struct symbol *s;  // symbol of label
+
+    hash = as->lx->names.names[id].hash;
+    s = find_symbol(&as->symbols,id,hash);
+    if (!s) {
+        s = add_symbol(&as->symbols,id,hash);
+    }
+    return s;
+}
+
+// Define label
+
+void define_label(struct assembler *as, uint32_t label, int value)
+{
+    // Give the label its value and patch every word that was waiting for it.
+    // A word whose expression needs yet another label goes on to wait for
+    // that one, so each fixup is run at most once per label it needs.
+
+    struct node *p;      // label node
+    struct symbol *s;    // symbol of label
+    struct symbol *next; // label expression still waits for
+    struct fixup *x;     // fixup being patched
+    uint32_t f;          // index of fixup
+    uint32_t following;  // index of fixup after it
+    int result;          // value of expression
+
+    p = &as->tree->nodes[label];
+    s = get_symbol(as,p->value);
+    if (s->defined) {
+        lexer_error(as->lx,p->offset,"Label %s is already defined",get_name(&as->lx->names,p->value));
+        return;
+    }
+    s->value = value;
+    s->defined = true;
+    f = s->fixups;
+    s->fixups = 0;
+
+    // Running an expression can add symbols and move the table, so s is
+    // not used past this point
+    for (; f; f=following) {
+        x = &as->fixups[f];
+        following = x->next;
+        if (!x->length) {
+            as->image[x->address] = value;
+        }
+        else if (run_expression(as,x->code,x->length,x,&result,&next)) {
+            as->image[x->address] = result;
+        }
+        else if (next) {
+            x->next = next->fixups;
+            next->fixups = f;
+        }
+    }
+}
+
+// Get value of operand that must be known now
+
+bool get_known_value(struct assembler *as, uint32_t op, int *value)
+{
+    struct node *p;         // operand node
+    struct symbol *s;       // symbol of operand
+    struct fixup at;        // where operand is, for errors
+    struct operation *code; // postfix program of expression
+    uint32_t i, j;          // indexes of operations
+
+    p = &as->tree->nodes[op];
+    if (p->kind == n_integer) {
+        *value = p->value;
+        return true;
+    }
+    at.offset = p->offset;
+    at.line = 0;
+    if (p->kind == n_symbol) {
+        s = get_symbol(as,p->value);
+        if (s->defined) {
+            *value = s->value;
+            return true;
+        }
+    }
+    else if (p->kind == n_expression) {
+        if (run_expression(as,p->value,p->length,&at,value,&s)) {
+            return true;
+        }
+        if (!s) {
+            return false;
+        }
+
+        // Report every label the expression is missing, each once
+        code = as->tree->code + p->value;
+        for (i=0; i<p->length; i++) {
+            if (code[i].op != o_label || get_symbol(as,code[i].value)->defined) {
+                continue;
+            }
+            for (j=0; j<i && !(code[j].op == o_label && code[j].value == code[i].value); j++);
+            if (j == i) {
+                lexer_error(as->lx,p->offset,"Label %s must be defined before it is used here",get_name(&as->lx->names,code[i].value));
+            }
+        }
+        return false;
+    }
+    else {
+        lexer_error(as->lx,p->offset,"Expected a value");
+        return false;
+    }
+    lexer_error(as->lx,p->offset,"Label %s must be defined before it is used here",get_name(&as->lx->names,s->id));
+    return false;
+}
+
+// Emit word at location counter
+
+void emit_word(struct assembler *as, int word, uint32_t offset)
+{
+    if (as->loc >= MEMORY_WORDS) {
+        if (!as->full) {
+            lexer_error(as->lx,offset,"Program does not fit in %d words of memory",MEMORY_WORDS);
+            as->full = true;
+        }
+        return;
+    }
+    as->image[as->loc++] = word;
+    if (as->loc > as->top) {
+        as->top = as->loc;
+    }
+}
+
+// Emit value operand
+
+void emit_operand(struct assembler *as, uint32_t op)
+{
+    // A value that needs a label not yet defined gets a fixup for the word
+    // about to be emitted
+
+    struct node *p;   // operand node
+    struct symbol *s; // symbol of label waited for
+    struct fixup at;  // where operand is, for errors
+    int value;        // value of expression
+
+    p = &as->tree->nodes[op];
+    if (p->kind == n_integer) {
+        emit_word(as,p->value,p->offset);
+        return;
+    }
+    if (p->kind == n_expression) {
+        at.offset = p->offset;
+        at.line = 0;
+        if (run_expression(as,p->value,p->length,&at,&value,&s)) {
+            emit_word(as,value,p->offset);
+        }
+        else {
+            if (s) {
+                add_fixup(as,s,p->value,p->length,p->offset);
+            }
+            emit_word(as,0,p->offset);
+        }
+        return;
+    }
+    s = get_symbol(as,p->value);
+    if (s->defined) {
+        emit_word(as,s->value,p->offset);
+        return;
+    }
+    add_fixup(as,s,0,0,p->offset);
+    emit_word(as,0,p->offset);
+}
+
+// Make word at location counter wait for label
+
+void add_fixup(struct assembler *as, struct symbol *s, uint32_t code, uint32_t length, uint32_t offset)
+{
+    // The line and column are found now, while the reference is still in
+    // the source text. A streaming lexer may have let go of it by the time
+    // the fixup is run or reported.
+
+    struct fixup *f; // fixup recorded
+    size_t line;     // line of reference
+    size_t column;   // column of reference
+
+    if (as->loc >= MEMORY_WORDS) {
+        return;
+    }
+    if (as->nfixups >= as->fixup_size) {
+        as->fixup_size = as->fixup_size ? as->fixup_size * 2 : 4096;
+        as->fixups = erealloc(as->fixups,as->fixup_size * sizeof(struct fixup));
+    }
+    f = &as->fixups[as->nfixups];
+    f->next = s->fixups;
+    f->address = as->loc;
+    f->offset = offset;
+    f->line = 0;
+    f->column = 0;
+    if (locate_offset(as->lx,offset,&line,&column) && line <= UINT32_MAX && column <= UINT32_MAX) {
+        f->line = line;
+        f->column = column;
+    }
+    f->code = code;
+    f->length = length;
+    s->fixups = as->nfixups++;
+}
+
+// Run postfix program of expression
+
+bool run_expression(struct assembler *as, uint32_t code, uint32_t length, const struct fixup *at, int *value, struct symbol **waiting)
+{
+    // Return true with the value if every label is defined. Otherwise return
+    // false, with the first label not yet defined in waiting, or with
+    // waiting NULL after reporting an error where at says.
+
+    unsigned int stack[EXPRESSION_STACK]; // values being worked on
+    struct operation *p;                  // operation
+    struct symbol *s;                     // symbol of label
+    uint32_t n;                           // number of values on stack
+    uint32_t i;                           // index of operation
+
+    *waiting = NULL;
+    n = 0;
+    for (i=code; i<code+length; i++) {
+        p = &as->tree->code[i];
+        switch (p->op) {
+            case o_const:
+            case o_label:
+                if (n == EXPRESSION_STACK) {
+                    fixup_error(as,at,"Expression is too complex");
+                    return false;
+                }
+                if (p->op == o_label) {
+                    s = get_symbol(as,p->value);
+                    if (!s->defined) {
+                        *waiting = s;
+                        return false;
+                    }
+                    stack[n++] = s->value;
                 }
                 else {
-                    next_state = 0;
+                    stack[n++] = p->value;
                 }
                 break;
+
+            case o_neg:
+            case o_not:
+                apply_operator(p->op,stack[n-1],0,&stack[n-1]);
+                break;
+
+            default:
+                if (!apply_operator(p->op,stack[n-2],stack[n-1],&stack[n-2])) {
+                    fixup_error(as,at,"Division by zero");
+                    return false;
+                }
+                n--;
+                break;
+        }
+    }
+    *value = stack[0];
+    return true;
+}
+
+// Apply operator to values
+
+bool apply_operator(operator op, unsigned int a, unsigned int b, unsigned int *result)
+{
+    // Values are target words, and so is the result. A unary operator
+    // takes a alone. Returns false on division by zero.
+
+    unsigned int r; // result before wrapping around
+
+    switch (op) {
+        case o_neg: r = -a; break;
+        case o_not: r = ~a; break;
+        case o_mul: r = a * b; break;
+        case o_div:
+        case o_mod:
+            if (b == 0) {
+                return false;
+            }
+            r = op == o_div ? a / b : a % b;
+            break;
+        case o_add: r = a + b; break;
+        case o_sub: r = a - b; break;
+        case o_shl: r = b < 16 ? a << b : 0; break;
+        case o_shr: r = b < 16 ? a >> b : 0; break;
+        case o_and: r = a & b; break;
+        case o_xor: r = a ^ b; break;
+        case o_or:  r = a | b; break;
+        default:    r = a; break;
+    }
+    *result = r & WORD_MAX;
+    return true;
+}
+
+// Finish assembly
+
+void finish_assembly(struct assembler *as)
+{
+    // Every label still waited on was never defined. An expression waits
+    // on one label at a time, so the other labels it needs may be
+    // undefined too. Report each undefined label once, at its first use,
+    // in the order of the source text.
+
+    struct symbol *s;        // symbol of label
+    struct fixup *x;         // fixup still waiting
+    struct label_use *uses;  // first use of label of each slot
+    struct label_use *u;     // first use of label
+    uint32_t *pending;       // fixups still waiting
+    int *waiting;            // ID of label each one waits on
+    uint32_t count;          // number of fixups still waiting
+    uint32_t f;              // index of fixup
+    uint32_t k;              // index into pending
+    uint32_t j;              // index of operation, or end for label waited on
+    size_t i;                // index of slot
+    size_t m;                // number of labels to report
+    int id;                  // ID of label used
+
+    pending = emalloc(as->nfixups * sizeof(uint32_t));
+    waiting = emalloc(as->nfixups * sizeof(int));
+    count = 0;
+    for (i=0; i<as->symbols.size; i++) {
+        s = &as->symbols.slots[i];
+        for (f=s->id ? s->fixups : 0; f; f=as->fixups[f].next) {
+            pending[count] = f;
+            waiting[count] = s->id;
+            count++;
+        }
+    }
+
+    // Give every label used a symbol before taking slots, since adding a
+    // symbol can move the table
+    for (k=0; k<count; k++) {
+        x = &as->fixups[pending[k]];
+        for (j=x->code; j<x->code+x->length; j++) {
+            if (as->tree->code[j].op == o_label) {
+                get_symbol(as,as->tree->code[j].value);
+            }
+        }
+    }
+
+    uses = emalloc(as->symbols.size * sizeof(struct label_use));
+    memset(uses,0,as->symbols.size * sizeof(struct label_use));
+    for (k=0; k<count; k++) {
+        x = &as->fixups[pending[k]];
+        for (j=x->code; j<=x->code+x->length; j++) {
+            if (j < x->code + x->length) {
+                if (as->tree->code[j].op != o_label) {
+                    continue;
+                }
+                id = as->tree->code[j].value;
+            }
+            else {
+                id = waiting[k];
+            }
+            s = get_symbol(as,id);
+            if (s->defined) {
+                continue;
+            }
+            u = &uses[s - as->symbols.slots];
+            if (!u->fixup || x->offset < u->offset || (x->offset == u->offset && j < u->op)) {
+                u->fixup = pending[k];
+                u->op = j;
+                u->offset = x->offset;
+                u->id = id;
+            }
+        }
+    }
+
+    m = 0;
+    for (i=0; i<as->symbols.size; i++) {
+        if (uses[i].fixup) {
+            uses[m++] = uses[i];
+        }
+    }
+    qsort(uses,m,sizeof(struct label_use),compare_label_uses);
+    for (i=0; i<m; i++) {
+        fixup_error(as,&as->fixups[uses[i].fixup],"Label %s is not defined",get_name(&as->lx->names,uses[i].id));
+    }
+    free(uses);
+    free(waiting);
+    free(pending);
+}
+
+// Compare first uses of labels for qsort()
+
+int compare_label_uses(const void *a, const void *b)
+{
+    const struct label_use *x = a;
+    const struct label_use *y = b;
+    if (x->offset != y->offset) {
+        return (x->offset > y->offset) - (x->offset < y->offset);
+    }
+    return (x->op > y->op) - (x->op < y->op);
+}
+
+// Report error at reference of fixup
+
+void fixup_error(struct assembler *as, const struct fixup *f, const char *format, ...)
+{
+    // Use the line and column saved with the fixup, and the offset if none
+    // were saved
+
+    char s[1024];
+    va_list args;
+    va_start(args,format);
+    vsnprintf(s,sizeof(s),format,args);
+    va_end(args);
+    TRACE_EVENT(te_error,0,f->offset,0,0);
+    if (f->line) {
+        error("Line %u, column %u: %s",(unsigned)f->line,(unsigned)f->column,s);
+        as->lx->errors++;
+    }
+    else {
+        lexer_error(as->lx,f->offset,"%s",s);
+    }
+}
+
+// Write memory image to file
+
+void write_image(struct assembler *as, const char *filename)
+{
+    // Words from address 0 up to the highest one placed, low byte first
+
+    FILE *fp;           // output file
+    unsigned char b[2]; // bytes of word
+    uint32_t i;         // address
+
+    fp = efopen(filename,"wb");
+    for (i=0; i<as->top; i++) {
+        b[0] = as->image[i] & 0xFF;
+        b[1] = as->image[i] >> 8;
+        fwrite(b,1,2,fp);
+    }
+    if (fclose(fp) != 0) {
+        fail("Unable to write %s",filename);
+    }
+}
+
+//=============================================================================
+// Symbol table
+//=============================================================================
+
+// Initialize symbol table
+
+void init_symbols(struct symbol_table *t)
+{
+    t->size = 1024;
+    t->slots = emalloc(t->size * sizeof(struct symbol));
+    memset(t->slots,0,t->size * sizeof(struct symbol));
+    t->count = 0;
+}
+
+// Release symbol table
+
+void release_symbols(struct symbol_table *t)
+{
+    free(t->slots);
+    t->slots = NULL;
+    t->size = t->count = 0;
+}
+
+// Find symbol of identifier
+
+struct symbol *find_symbol(struct symbol_table *t, int id, uint32_t hash)
+{
+    // Open addressing with linear probing, keyed on the identifier ID. The
+    // identifier's hash, worked out once by the lexer, picks the first slot,
+    // so a lookup touches no text and usually no more than one slot.
+
+    size_t mask;
+    size_t i;
+
+    mask = t->size - 1;
+    for (i = hash & mask; t->slots[i].id != 0; i = (i + 1) & mask) {
+        if (t->slots[i].id == (uint32_t)id) {
+            return &t->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Add symbol of identifier not yet in table
+
+struct symbol *add_symbol(struct symbol_table *t, int id, uint32_t hash)
+{
+    struct symbol *s;
+    size_t mask;
+    size_t i;
+
+    // Keep the table at most half full so probe runs stay short
+    if ((t->count + 1) * 2 > t->size) {
+        grow_symbols(t);
+    }
+    mask = t->size - 1;
+    for (i = hash & mask; t->slots[i].id != 0; i = (i + 1) & mask) {
+    }
+    s = &t->slots[i];
+    s->id = id;
+    s->hash = hash;
+    s->fixups = 0;
+    s->value = 0;
+    s->defined = false;
+    t->count++;
+    return s;
+}
+
+// Double slots of symbol table
+
+void grow_symbols(struct symbol_table *t)
+{
+    // All symbols move to the new slots in one sweep. They keep their
+    // hashes, so moving them never goes back to the identifier table.
+
+    struct symbol *old; // slots before growing
+    size_t size;        // number of slots before growing
+    size_t mask;
+    size_t i, j;
+
+    old = t->slots;
+    size = t->size;
+    t->size *= 2;
+    t->slots = emalloc(t->size * sizeof(struct symbol));
+    memset(t->slots,0,t->size * sizeof(struct symbol));
+    mask = t->size - 1;
+    for (j=0; j<size; j++) {
+        if (!old[j].id) {
+            continue;
+        }
+        for (i = old[j].hash & mask; t->slots[i].id != 0; i = (i + 1) & mask) {
+        }
+        t->slots[i] = old[j];
+    }
+    free(old);
+}
+
+//=============================================================================
+// Identifier table
+//=============================================================================
+
+// Initialize identifier table
+
+void init_names(struct name_table *t)
+{
+    t->size = 1024;
+    t->slots = emalloc(t->size * sizeof(uint32_t));
+    memset(t->slots,0,t->size * sizeof(uint32_t));
+    t->capacity = 256;
+    t->names = emalloc(t->capacity * sizeof(struct name));
+    t->count = 1;
+    t->arena.head = NULL;
+}
+
+// Release identifier table
+
+void release_names(struct name_table *t)
+{
+    free(t->slots);
+    free(t->names);
+    arena_release(&t->arena);
+    t->slots = NULL;
+    t->names = NULL;
+    t->size = t->count = t->capacity = 0;
+}
+
+// Hash identifier
+
+uint32_t hash_name(const char *s, size_t len)
+{
+    // FNV-1a
+    uint32_t h;
+    size_t i;
+
+    h = 2166136261u;
+    for (i=0; i<len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Get ID of identifier, adding it to the table if it is new
+
+int intern_name(struct name_table *t, const char *s, size_t len, uint32_t hash)
+{
+    // Open addressing with linear probing. Slots hold only IDs; the hash
+    // kept with each name means text is compared only when hashes match.
+
+    struct name *n;
+    size_t mask;
+    size_t i;
+    uint32_t id;
+
+    mask = t->size - 1;
+    for (i = hash & mask; (id = t->slots[i]) != 0; i = (i + 1) & mask) {
+        n = &t->names[id];
+        if (n->hash == hash && n->length == len && memcmp(n->text,s,len) == 0) {
+            return id;
+        }
+    }
+
+    if (t->count == t->capacity) {
+        t->capacity *= 2;
+        t->names = erealloc(t->names,t->capacity * sizeof(struct name));
+    }
+    id = t->count++;
+    n = &t->names[id];
+    n->text = arena_substr(&t->arena,s,len);
+    n->length = len;
+    n->hash = hash;
+    n->keyword = find_keyword(s,len);
+    t->slots[i] = id;
+
+    // Keep the table at most half full so probe runs stay short
+    if (t->count * 2 > t->size) {
+        grow_names(t);
+    }
+    return id;
+}
+
+// Double slots of identifier table
+
+void grow_names(struct name_table *t)
+{
+    // Names keep their hashes, so moving them never rehashes any text
+    size_t mask;
+    size_t i;
+    uint32_t id;
+
+    free(t->slots);
+    t->size *= 2;
+    t->slots = emalloc(t->size * sizeof(uint32_t));
+    memset(t->slots,0,t->size * sizeof(uint32_t));
+    mask = t->size - 1;
+    for (id=1; id<t->count; id++) {
+        for (i = t->names[id].hash & mask; t->slots[i] != 0; i = (i + 1) & mask) {
+        }
+        t->slots[i] = id;
+    }
+}
+
+// Get text of identifier with given ID
+
+const char *get_name(const struct name_table *t, int id)
+{
+    return t->names[id].text;
+}
+
+//=============================================================================
+// Keywords
+//=============================================================================
+
+// Keywords are found through a perfect hash of their length and their
+// first, second and last characters. Every keyword gets a slot of its own
+// in the table below, placed at compile time. A new keyword that collides
+// with another is a compile error (overriding an initialized slot); pick
+// other multipliers for KEYWORD_HASH if that happens.
+
+#define KEYWORD_SLOTS 64     // slots in keyword table, a power of two
+#define KEYWORD_MAX_LENGTH 4 // length of longest keyword
+
+#define KEYWORD_HASH(len, c0, c1, cl) \
+    ((2 * (c0) + (c1) + 44 * (cl) + (len)) & (KEYWORD_SLOTS - 1))
+
+#define LENGTH(name) (sizeof(#name) - 1)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+
+const struct keyword keywords[KEYWORD_SLOTS] = {
+#define X(name, c0, c1, cl, format) \
+    [KEYWORD_HASH(LENGTH(name),c0,c1,cl)] = { #name, LENGTH(name), kk_mnemonic, m_##name },
+    MNEMONICS(X)
+#undef X
+#define X(name, c0, c1, cl, n) \
+    [KEYWORD_HASH(LENGTH(name),c0,c1,cl)] = { #name, LENGTH(name), kk_register, n },
+    REGISTERS(X)
+#undef X
+#define X(name, c0, c1, cl) \
+    [KEYWORD_HASH(LENGTH(name),c0,c1,cl)] = { #name, LENGTH(name), kk_directive, d_##name },
+    DIRECTIVES(X)
+#undef X
+};
+
+#pragma GCC diagnostic pop
+
+// The hash characters of every keyword must be those of its name, or the
+// keyword is filed where lookups never look. GCC folds memchr() on a string
+// literal, so a slip in the lists above is a compile error.
+
+#define KEYWORD_CHARS_MATCH(name, c0, c1, cl) \
+    (__builtin_memchr(#name,c0,1) && __builtin_memchr(#name + 1,c1,1) && \
+     __builtin_memchr(#name + LENGTH(name) - 1,cl,1))
+
+#define X(name, c0, c1, cl, format) \
+    _Static_assert(KEYWORD_CHARS_MATCH(name,c0,c1,cl),"Hash characters of " #name " do not match its name");
+MNEMONICS(X)
+#undef X
+#define X(name, c0, c1, cl, n) \
+    _Static_assert(KEYWORD_CHARS_MATCH(name,c0,c1,cl),"Hash characters of " #name " do not match its name");
+REGISTERS(X)
+#undef X
+#define X(name, c0, c1, cl) \
+    _Static_assert(KEYWORD_CHARS_MATCH(name,c0,c1,cl),"Hash characters of " #name " do not match its name");
+DIRECTIVES(X)
+#undef X
+
+#undef KEYWORD_CHARS_MATCH
+#undef LENGTH
+
+// Find keyword spelled by identifier
+
+const struct keyword *find_keyword(const char *s, size_t len)
+{
+    // Keywords are case-insensitive. Identifiers hold only letters, digits
+    // and underscores, so setting bit 5 folds case without changing digits;
+    // it turns an underscore into DEL, which no keyword contains.
+
+    const struct keyword *k;
+    size_t i;
+
+    if (len < 2 || len > KEYWORD_MAX_LENGTH) {
+        return NULL;
+    }
+    k = &keywords[KEYWORD_HASH(len,s[0]|0x20,s[1]|0x20,s[len-1]|0x20)];
+    if (k->length != len) {
+        return NULL;
+    }
+    for (i=0; i<len; i++) {
+        if ((s[i] | 0x20) != k->name[i]) {
+            return NULL;
+        }
+    }
+    return k;
+}
+
+//=============================================================================
+// Arena
+//=============================================================================
+
+// Allocate from arena
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    // Hand out memory by bumping the used count of the current block. When
+    // the block is full, chain a new one in front of it; blocks are never
+    // freed individually, only all together by arena_release().
+
+    struct arena_block *b;
+    size_t capacity;
+    void *p;
+
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    b = a->head;
+#ifdef BENCHMARK
+    alloc_counts.arena++;
+#endif
+
+    if (!b || b->size - b->used < size) {
+        capacity = 65536;
+        if (size > capacity) {
+            capacity = size;
+        }
+        b = emalloc(sizeof(struct arena_block) + capacity);
+        b->next = a->head;
+        b->size = capacity;
+        b->used = 0;
+        a->head = b;
+    }
+
+    p = (char *)b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+// Copy string slice into arena
+
+char *arena_substr(struct arena *a, const char *s, size_t len)
+{
+    char *p;
+    p = arena_alloc(a,len+1);
+    memcpy(p,s,len);
+    p[len] = '\0'; // add string terminator
+    return p;
+}
+
+// Release arena
+
+void arena_release(struct arena *a)
+{
+    struct arena_block *b;
+    struct arena_block *next;
+
+    for (b = a->head; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->head = NULL;
+}
+
+//=============================================================================
+// Error-trapped functions
+//=============================================================================
+
+// fopen()
+
+FILE *efopen(const char *filename, const char *mode)
+{
+    FILE *p;
+    p = fopen(filename,mode);
+    if (!p) {
+        fail("Something went wrong. Unable to open file %s", filename);
+    }
+    return p;
+}
+
+// malloc()
+
+void *emalloc(size_t size)
+{
+    void *p;
+    p = malloc(size);
+    if (!p) {
+        fail("Something went wrong. Unable to allocate memory");
+    }
+#ifdef BENCHMARK
+    alloc_counts.heap++;
+#endif
+    return p;
+}
+
+// realloc()
+
+void *erealloc(void *ptr, size_t size)
+{
+    void *p;
+    p = realloc(ptr,size);
+    if (!p) {
+        fail("Something went wrong. Unable to allocate memory");
+    }
+#ifdef BENCHMARK
+    alloc_counts.heap++;
+#endif
+    return p;
+}
+
+//=============================================================================
+// Instrumentation
+//=============================================================================
+
+#ifdef INSTRUMENT
+
+// Add counts of running thread to totals
+
+void merge_counts()
+{
+    // Each thread counts into its own copy so the lexer never contends on
+    // a counter; a thread hands its counts over when it closes a lexer.
+
+    unsigned long *from; // counts of running thread
+    unsigned long *to;   // totals
+    size_t i;            // index
+
+    from = (unsigned long *)&lexer_counts;
+    to = (unsigned long *)&lexer_totals;
+    pthread_mutex_lock(&lexer_totals_lock);
+    for (i=0; i<sizeof(struct lexer_counts)/sizeof(unsigned long); i++) {
+        to[i] += from[i];
+    }
+    pthread_mutex_unlock(&lexer_totals_lock);
+    memset(&lexer_counts,0,sizeof(lexer_counts));
+}
+
+// Write counts as JSON to standard error
+
+void dump_counts()
+{
+    static const char *states[LEXER_STATES] = {
+        "S0", "S1", "S2", "S3", "S4", "S5", "S5.1", "S6", "S6.1", "S7", "S8"
+    };
+    static const char *recognizers[rc_count] = {
+        "classify_lexeme", "is_id", "is_int", "is_bin", "is_oct", "is_dec",
+        "is_hex", "is_sqstr", "is_dqstr"
+    };
+
+    struct lexer_counts *c; // totals
+    unsigned long ntokens;  // number of tokens of every type
+    const char *sep;        // separator before next member
+    int i, j;               // indexes
+
+    merge_counts();
+    c = &lexer_totals;
+
+    fprintf(stderr,"{\n  \"transitions\": {");
+    sep = "";
+    for (i=0; i<LEXER_STATES; i++) {
+        for (j=0; j<LEXER_STATES; j++) {
+            if (c->transitions[i][j]) {
+                fprintf(stderr,"%s\n    \"%s->%s\": %lu",sep,states[i],states[j],c->transitions[i][j]);
+                sep = ",";
+            }
         }
     }
-    return validity;
+    fprintf(stderr,"\n  },\n  \"tokens\": {");
+    ntokens = 0;
+    for (i=0; i<=t_unknown; i++) {
+        fprintf(stderr,"%s\n    \"%s\": %lu",i ? "," : "",get_meaning(i),c->tokens[i]);
+        ntokens += c->tokens[i];
+    }
+    fprintf(stderr,"\n  },\n  \"bytes\": {");
+    fprintf(stderr,"\n    \"source\": %lu,",c->source_bytes);
+    fprintf(stderr,"\n    \"lexemes\": %lu,",c->lexeme_bytes);
+    fprintf(stderr,"\n    \"comments\": %lu,",c->comment_bytes);
+    fprintf(stderr,"\n    \"single_quote_strings\": %lu,",c->sqstring_bytes);
+    fprintf(stderr,"\n    \"double_quote_strings\": %lu",c->dqstring_bytes);
+    fprintf(stderr,"\n  },\n  \"bytes_per_token\": %.2f,",ntokens ? (double)c->source_bytes / ntokens : 0.0);
+    fprintf(stderr,"\n  \"calls\": {");
+    for (i=0; i<rc_count; i++) {
+        fprintf(stderr,"%s\n    \"%s\": %lu",i ? "," : "",recognizers[i],c->calls[i]);
+    }
+    fprintf(stderr,"\n  }\n}\n");
 }
 
-// Recognize single-quote string
+#endif
 
-bool is_sqstr(const char *s)
+//=============================================================================
+// Tracing
+//=============================================================================
+
+#ifdef TRACE
+
+// Open trace file
+
+void open_trace()
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
-    
-    i = 0;
-    done = false;
-    next_state = 2;
-    
-    while (!done) { 
-    
-        c = s[i++];
-        current_state = next_state;
-        
-        switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
-                
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
-            
-                // Valid
-                
-                validity = true;
-                done = true;
-                break;
-                
-            case 2:
-            
-                // Accept opening single-quotation mark. Deny anything else.
-                
-                if (is_sqmark(c)) {
-                    next_state = 3;
-                }
-                else {  
-                    next_state = 0;
-                }
-                break;
-                
-            case 3:
-            
-                // Accept any visible ASCII character, except for the
-                // single-quotation mark. Or, accept closing single-quotation mark.
-                // Deny anything else.
-                
-                if (is_visible_ascii_character(c) && c != '\'') {
-                    next_state = current_state;
-                }
-                else if (is_sqmark(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 4:
-            
-                // Accept EOS; deny anything else.
-                
-                if (is_eos(c)) {
-                    next_state = 1;
-                }
-                else {  
-                    next_state = 0;
-                }
+    const char *path; // name of trace file
+
+    path = getenv("OSA_TRACE");
+    if (!path) {
+        path = "osa.trace";
+    }
+    trace_fd = open(path,O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,0644);
+    if (trace_fd < 0) {
+        fail("Unable to open trace file %s",path);
+    }
+    atexit(flush_trace);
+}
+
+// Record trace event
+
+void trace(trace_event event, int type, size_t offset, size_t length, int value)
+{
+    // Recording an event is a store into the thread's own ring; the ring is
+    // written out in one go only when it fills up, or when the thread
+    // closes a lexer.
+
+    struct trace_ring *ring; // ring of running thread
+    struct trace_record *p;  // record being filled
+
+    ring = &trace_ring;
+    if (ring->head - ring->tail == TRACE_RING_SIZE) {
+        flush_trace();
+    }
+    if (!ring->thread) {
+        ring->thread = __atomic_add_fetch(&trace_threads,1,__ATOMIC_RELAXED);
+    }
+    p = &ring->records[ring->head++ & (TRACE_RING_SIZE - 1)];
+    p->event = event;
+    p->thread = ring->thread;
+    p->length = length;
+    p->offset = offset;
+    p->value = value;
+    p->type = type;
+}
+
+// Write trace records of running thread to trace file
+
+void flush_trace()
+{
+    // The records waiting in the ring make at most two runs, one up to the
+    // end of the ring and one from its start. The file is opened for
+    // appending, so whole runs from several threads never overwrite each
+    // other.
+
+    struct trace_ring *ring; // ring of running thread
+    size_t start;            // index of first record to write
+    size_t count;            // number of records to write in this run
+    ssize_t n;               // number of bytes written
+
+    ring = &trace_ring;
+    if (trace_fd < 0) {
+        ring->tail = ring->head;
+        return;
+    }
+    while (ring->tail != ring->head) {
+        start = ring->tail & (TRACE_RING_SIZE - 1);
+        count = ring->head - ring->tail;
+        if (count > TRACE_RING_SIZE - start) {
+            count = TRACE_RING_SIZE - start;
         }
+        n = write(trace_fd,&ring->records[start],count * sizeof(struct trace_record));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n != (ssize_t)(count * sizeof(struct trace_record))) {
+            fail("Unable to write trace file");
+        }
+        ring->tail += count;
     }
-    return validity;
 }
 
-// Recognize double-quote string
+#endif
 
-bool is_dqstr(const char *s)
+//=============================================================================
+// Benchmarks
+//=============================================================================
+
+// Build with -DBENCHMARK to replace the assembler's entry point with the
+// benchmark driver.
+
+#ifdef BENCHMARK
+
+// Run benchmark named on command line
+
+int benchmark(int argc, char *argv[])
 {
-    int current_state;
-    int next_state;
-    bool validity;
-    bool done;
-    int c;
-    int i;
-    
-    i = 0;
-    done = false;
-    next_state = 2;
-    
-    while (!done) { 
-    
-        c = s[i++];
-        current_state = next_state;
-        
-        switch(current_state) {
-        
-            case 0:
-            
-                // Invalid
+    if (argc == 2 && strcmp(argv[1],"digits") == 0) {
+        bench_digits();
+    }
+    else if (argc == 3 && strcmp(argv[1],"lex") == 0) {
+        bench_lex(argv[2]);
+    }
+    else if (argc == 3 && strcmp(argv[1],"parallel") == 0) {
+        bench_parallel(argv[2]);
+    }
+    else if (argc == 2 && strcmp(argv[1],"keywords") == 0) {
+        bench_keywords();
+    }
+    else if ((argc == 4 || argc == 5) && strcmp(argv[1],"corpus") == 0) {
+        write_corpus(argv[2],argv[3],argc == 5 ? argv[4] : NULL);
+    }
+    else if ((argc == 2 || argc == 3) && strcmp(argv[1],"suite") == 0) {
+        bench_suite(argc == 3 ? argv[2] : "16M");
+    }
+    else if (argc == 2 && strcmp(argv[1],"recognizers") == 0) {
+        bench_recognizers();
+    }
+    else if (argc == 3 && strcmp(argv[1],"tree") == 0) {
+        bench_tree(argv[2]);
+    }
+    else if (argc == 2 && strcmp(argv[1],"symbols") == 0) {
+        bench_symbols();
+    }
+    else if (argc == 3 && strcmp(argv[1],"positions") == 0) {
+        check_positions(argv[2]);
+    }
+    else {
+        printf("Usage: %s digits\n", argv[0]);
+        printf("       %s lex <file>\n", argv[0]);
+        printf("       %s parallel <file>\n", argv[0]);
+        printf("       %s keywords\n", argv[0]);
+        printf("       %s corpus <kind> <size> [file]\n", argv[0]);
+        printf("       %s suite [size]\n", argv[0]);
+        printf("       %s recognizers\n", argv[0]);
+        printf("       %s tree <file>\n", argv[0]);
+        printf("       %s symbols\n", argv[0]);
+        printf("       %s positions <file>\n", argv[0]);
+    }
+    return 0;
+}
 
-                validity = false;
-                done = true;
-                break;
-                
-            case 1:
-            
-                // Valid
+// Get monotonic time in seconds
 
-                validity = true;
-                done = true;
-                break;
-                
-            case 2:
-            
-                // Accept opening double-quotation mark. Deny all others.
-               
-                if (is_dqmark(c)) {
-                    next_state = 3;
-                }
-                else {  
-                    next_state = 0;
-                }
-                break;
-                
-            case 3:
-            
-                // Accept any visible ASCII character except the double-quotation
-                // mark. Or, accept closing double-quotation mark.
-                // Deny anything else.
+double get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-                if (is_visible_ascii_character(c) && c != '"') {
-                    next_state = current_state;
-                }
-                else if (is_dqmark(c)) {
-                    next_state = 4;
-                }
-                else {
-                    next_state = 0;
-                }
-                break;
-                
-            case 4:
-            
-                // Accept EOS; deny anything else.
+// Parse digits with eval()
 
-                if (is_eos(c)) {
-                    next_state = 1;
+size_t parse_digits_eval(const char *s, size_t len, int base, unsigned int *value)
+{
+    *value = eval(s,len,base);
+    return len;
+}
+
+// Benchmark digit parsers
+
+void bench_digits()
+{
+    // Time every digit parser the CPU supports against the scalar eval()
+    // path on literals of 8 and 16 digits in each base the lexer accepts.
+
+    enum { COUNT = 4096, ROUNDS = 1000 };
+
+    static const int bases[] = { 2, 8, 10, 16 };
+    static const size_t widths[] = { 8, 16 };
+    static char digits[COUNT][16];
+
+    struct {
+        const char *name;
+        size_t (*parse)(const char *, size_t, int, unsigned int *);
+        bool supported;
+    } parsers[] = {
+        { "eval",   parse_digits_eval,   true },
+        { "scalar", parse_digits_scalar, true },
+        { "swar",   parse_digits_swar,   true },
+#ifdef HAVE_X86_SIMD
+        { "sse2",   parse_digits_sse2,   __builtin_cpu_supports("sse2") },
+        { "ssse3",  parse_digits_ssse3,  __builtin_cpu_supports("ssse3") },
+#endif
+    };
+
+    unsigned int value;  // value of literal
+    unsigned long sink;  // keeps results alive
+    double start;        // start time
+    double elapsed;      // elapsed time
+    size_t b, w, p;      // indexes into tables
+    int i, r, d;         // loop counters
+
+    printf("%-6s %-6s %-8s %12s\n", "base", "digits", "parser", "ns/literal");
+
+    sink = 0;
+    for (b=0; b<sizeof(bases)/sizeof(bases[0]); b++) {
+        srand(1);
+        for (i=0; i<COUNT; i++) {
+            for (d=0; d<16; d++) {
+                digits[i][d] = "0123456789abcdef"[rand() % bases[b]];
+            }
+        }
+        for (w=0; w<sizeof(widths)/sizeof(widths[0]); w++) {
+            for (p=0; p<sizeof(parsers)/sizeof(parsers[0]); p++) {
+                if (!parsers[p].supported) {
+                    continue;
                 }
-                else {  
-                    next_state = 0;
+                start = get_time();
+                for (r=0; r<ROUNDS; r++) {
+                    for (i=0; i<COUNT; i++) {
+                        value = 0;
+                        sink += parsers[p].parse(digits[i],widths[w],bases[b],&value);
+                        sink += value;
+                    }
                 }
+                elapsed = get_time() - start;
+                printf("%-6d %-6zu %-8s %12.2f\n", bases[b], widths[w], parsers[p].name,
+                       elapsed * 1e9 / ((double)ROUNDS * COUNT));
+            }
         }
     }
-    return validity;
+    printf("(checksum %lu)\n", sink);
 }
 
-// ATOM RECOGNIZERS 
-
-// Recognize binary digit
+// Benchmark lexer
 
-bool is_bindigit(int c)
+void bench_lex(const char *filename)
 {
-    if (c == '0' || c == '1') {
-        return true;
+    // Lex a file repeatedly with each set of scanners the CPU supports,
+    // through get_next_token() and through lex_batch(), and report the
+    // best round.
+
+    enum { ROUNDS = 10 };
+
+    struct {
+        const char *name;
+        const char *(*find_eol)(const char *, const char *);
+        const char *(*skip_blanks)(const char *, const char *);
+        bool supported;
+    } scanners[] = {
+        { "scalar", find_eol_scalar, skip_blanks_scalar, true },
+#ifdef HAVE_X86_SIMD
+        { "sse2",   find_eol_sse2,   skip_blanks_sse2,   __builtin_cpu_supports("sse2") },
+        { "avx2",   find_eol_avx2,   skip_blanks_avx2,   __builtin_cpu_supports("avx2") },
+#endif
+    };
+
+    static const char *apis[] = { "token", "batch" };
+
+    struct lexer source;      // lexer holding the loaded source text
+    struct lexer lexer;       // lexer for one round
+    struct token *token;      // current token
+    struct token_block block; // current token block
+    unsigned long count;      // tokens per round
+    FILE *src;                // source file
+    double start;             // start time
+    double best;              // fastest round
+    double size;              // source size in megabytes
+    size_t s;                 // index into scanners
+    int a;                    // index into apis
+    int r;                    // round
+
+    src = efopen(filename,"rb");
+    init_lexer(&source);
+    load_source(&source,src);
+    fclose(src);
+    size = (source.end - source.buf) / 1e6;
+
+    printf("%-8s %-6s %10s %12s\n", "scanners", "api", "MB/s", "Mtokens/s");
+    for (s=0; s<sizeof(scanners)/sizeof(scanners[0]); s++) {
+        if (!scanners[s].supported) {
+            continue;
+        }
+        for (a=0; a<2; a++) {
+            best = 0;
+            count = 0;
+            for (r=0; r<ROUNDS; r++) {
+                open_lexer_buffer(&lexer,source.buf,source.end-source.buf);
+                find_eol = scanners[s].find_eol;
+                skip_blanks = scanners[s].skip_blanks;
+                count = 0;
+                start = get_time();
+                if (a == 0) {
+                    do {
+                        token = get_next_token(&lexer);
+                        count++;
+                    } while (token->type != t_eof);
+                }
+                else {
+                    do {
+                        count += lex_batch(&lexer,&block);
+                    } while (block.types[block.count-1] != t_eof);
+                }
+                start = get_time() - start;
+                close_lexer(&lexer);
+                if (r == 0 || start < best) {
+                    best = start;
+                }
+            }
+            printf("%-8s %-6s %10.1f %12.2f\n", scanners[s].name, apis[a], size / best, count / best / 1e6);
+        }
     }
-    return false;
+
+    close_lexer(&source);
 }
 
-// Recognize octal digit
+// Benchmark parallel lexer
 
-bool is_octdigit(int c)
+void bench_parallel(const char *filename)
 {
-    if (is_digit(c) && (c!='8' && c!='9')) {
-        return true;
+    // Lex a file with 1 to 16 threads and report the best round of each,
+    // along with the speedup over a single thread.
+
+    enum { ROUNDS = 5 };
+
+    static const int counts[] = { 1, 2, 4, 8, 16 };
+
+    struct lexer lexer;        // lexer holding the source text
+    struct token_list tokens;  // tokens of one round
+    FILE *src;                 // source file
+    double start;              // start time
+    double best;               // fastest round
+    double base;               // fastest round with one thread
+    double size;               // source size in megabytes
+    size_t t;                  // index into counts
+    int r;                     // round
+
+    src = efopen(filename,"rb");
+    open_lexer(&lexer,src);
+    fclose(src);
+    size = (lexer.end - lexer.buf) / 1e6;
+
+    printf("%-8s %10s %12s %8s\n", "threads", "MB/s", "Mtokens/s", "speedup");
+    base = 0;
+    for (t=0; t<sizeof(counts)/sizeof(counts[0]); t++) {
+        best = 0;
+        tokens.count = 0;
+        for (r=0; r<ROUNDS; r++) {
+            start = get_time();
+            lex_parallel(&lexer,counts[t],&tokens);
+            start = get_time() - start;
+            report_deferred(&lexer,SIZE_MAX);
+            if (r != ROUNDS - 1) {
+                release_token_list(&tokens);
+            }
+            if (r == 0 || start < best) {
+                best = start;
+            }
+        }
+        if (t == 0) {
+            base = best;
+        }
+        printf("%-8d %10.1f %12.2f %8.2f\n", counts[t], size / best, tokens.count / best / 1e6, base / best);
+        release_token_list(&tokens);
     }
-    return false;
+
+    close_lexer(&lexer);
 }
 
-// Recognize decimal digit
+// Find keyword by comparing against every keyword in turn
 
-bool is_decdigit(int c)
+const struct keyword *find_keyword_chain(const char *s)
 {
-    if (is_digit(c)) {
-        return true;
+    size_t i;
+
+    for (i=0; i<KEYWORD_SLOTS; i++) {
+        if (keywords[i].length && strcasecmp(s,keywords[i].name) == 0) {
+            return &keywords[i];
+        }
     }
-    return false;
+    return NULL;
 }
 
-// Recognize hexadecimal digit
+// Benchmark keyword lookup
 
-bool is_hexdigit(int c)
+void bench_keywords()
 {
-    if (is_digit(c)) {
-        return true;
+    // Look up a mix of keywords in both cases and ordinary labels with the
+    // perfect hash and with a strcasecmp() chain, after checking that both
+    // agree on every sample.
+
+    enum { COUNT = 4096, ROUNDS = 2000 };
+
+    static const char *labels[] = {
+        "loop", "main", "start", "buffer_end", "x1", "r8", "adds", "jump",
+        "count", "print_string", "done", "lda", "src_ptr", "table", "st_1"
+    };
+    static char samples[COUNT][16];
+    static size_t lengths[COUNT];
+
+    const char *name;      // sample before case change
+    unsigned long sink;    // keeps results alive
+    double start;          // start time
+    double hashed;         // time taken by perfect hash
+    double chained;        // time taken by strcasecmp() chain
+    int nkeywords;         // number of keyword samples
+    int i, r;              // loop counters
+    size_t j;              // index into sample
+
+    srand(1);
+    nkeywords = 0;
+    for (i=0; i<COUNT; i++) {
+        if (rand() % 2) {
+            do {
+                name = keywords[rand() % KEYWORD_SLOTS].name;
+            } while (!name);
+            nkeywords++;
+        }
+        else {
+            name = labels[rand() % (sizeof(labels)/sizeof(labels[0]))];
+        }
+        lengths[i] = strlen(name);
+        for (j=0; j<=lengths[i]; j++) {
+            samples[i][j] = rand() % 4 ? name[j] : touppercase(name[j]);
+        }
     }
-    else if (tolowercase(c) >= 'a' && tolowercase(c) <= 'f') {
-        return true;
+
+    for (i=0; i<COUNT; i++) {
+        if (find_keyword(samples[i],lengths[i]) != find_keyword_chain(samples[i])) {
+            fail("Keyword lookups disagree on %s",samples[i]);
+        }
+    }
+    for (i=0; i<KEYWORD_SLOTS; i++) {
+        if (keywords[i].length && find_keyword(keywords[i].name,keywords[i].length) != &keywords[i]) {
+            fail("Keyword %s is keyed on the wrong characters",keywords[i].name);
+        }
     }
-    return false;    
-}
 
-// Recognize digit
+    sink = 0;
+    start = get_time();
+    for (r=0; r<ROUNDS; r++) {
+        for (i=0; i<COUNT; i++) {
+            sink += (uintptr_t)find_keyword(samples[i],lengths[i]);
+        }
+    }
+    hashed = get_time() - start;
 
-bool is_digit(int c)
-{
-    if (c >= '0' && c <= '9') {
-        return true;
+    start = get_time();
+    for (r=0; r<ROUNDS; r++) {
+        for (i=0; i<COUNT; i++) {
+            sink += (uintptr_t)find_keyword_chain(samples[i]);
+        }
     }
-    return false;
+    chained = get_time() - start;
+
+    printf("%d of %d samples are keywords\n", nkeywords, COUNT);
+    printf("%-8s %12s\n", "lookup", "ns/lookup");
+    printf("%-8s %12.2f\n", "hash", hashed * 1e9 / ((double)ROUNDS * COUNT));
+    printf("%-8s %12.2f\n", "chain", chained * 1e9 / ((double)ROUNDS * COUNT));
+    printf("(checksum %lu)\n", sink & 0xFFFF);
 }
 
-// Recognize letter
+// Get CPU cycle count
 
-bool is_letter(int c)
+uint64_t get_cycles()
 {
-    c = tolowercase(c);
-    if (c >= 'a' && c <= 'z') {
-        return true;
-    }
-    return false;
+#ifdef HAVE_X86_SIMD
+    return __rdtsc();
+#else
+    return 0;
+#endif
 }
 
-// Recognize any visible ASCII character
+// Parse size with optional K, M or G suffix
 
-bool is_visible_ascii_character(int c) 
+size_t parse_size(const char *s)
 {
-    // Visible ASCII characters run a value range of 32 - 126
-    if (c >= 32 && c <= 126) { 
-        return true;
+    char *end;
+    size_t size;
+
+    size = strtoul(s,&end,10);
+    switch (*end) {
+        case 'G': case 'g':
+            size <<= 10;
+            // fall through
+        case 'M': case 'm':
+            size <<= 10;
+            // fall through
+        case 'K': case 'k':
+            size <<= 10;
+            break;
     }
-    return false;
+    return size;
 }
 
-// MISC RECOGNIZERS
+// SYNTHETIC CORPORA
 
-// Recognize end-of-string character
+// Kinds of corpus
 
-bool is_eos(int c)
+enum {
+    ck_identifiers,
+    ck_numbers,
+    ck_comments,
+    ck_strings,
+    ck_mixed,
+    ck_count
+};
+
+const char *corpus_kinds[ck_count] = {
+    [ck_identifiers] = "identifiers",
+    [ck_numbers]     = "numbers",
+    [ck_comments]    = "comments",
+    [ck_strings]     = "strings",
+    [ck_mixed]       = "mixed"
+};
+
+// State of corpus random number generator. Corpora come from their own
+// generator with a fixed seed, so they are the same on every platform.
+
+uint64_t corpus_state;
+
+// Identifiers used by corpora. Real sources use the same few labels and
+// mnemonics over and over, so corpora draw identifiers from a fixed
+// vocabulary instead of making up a new one every time.
+
+#define CORPUS_WORDS 1024
+
+char corpus_words[CORPUS_WORDS][16];
+
+// Find corpus kind by name
+
+int find_corpus_kind(const char *name)
 {
-    if (c == '\0') {
-        return true;
+    int k;
+
+    for (k=0; k<ck_count; k++) {
+        if (strcmp(name,corpus_kinds[k]) == 0) {
+            return k;
+        }
     }
-    return false;
+    return -1;
 }
 
-// Recognize end-of-line character
+// Get random number below n
 
-bool is_eol(int c)
+uint32_t corpus_random(uint32_t n)
 {
-    if (c == '\n') {
-        return true;
-    }
-    return false;
+    // xorshift64*
+    corpus_state ^= corpus_state >> 12;
+    corpus_state ^= corpus_state << 25;
+    corpus_state ^= corpus_state >> 27;
+    return ((corpus_state * 2685821657736338717ULL) >> 32) % n;
 }
 
-// Recognize end-of-file indicator
+// Write random word for vocabulary
 
-bool is_eof(int c)
+size_t corpus_word(char *p)
 {
-    if (c == EOF) {
-        return true;
+    // Words never start with a hex digit, so none of them reads as a
+    // hexadecimal literal
+
+    static const char first[] = "ghijklmnopqrstuvwxyzGHIJKLMNOPQRSTUVWXYZ_";
+    static const char rest[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+
+    size_t len;
+    size_t i;
+
+    len = 1 + corpus_random(12);
+    p[0] = first[corpus_random(sizeof(first) - 1)];
+    for (i=1; i<len; i++) {
+        p[i] = rest[corpus_random(sizeof(rest) - 1)];
     }
-    return false;
+    p[len] = '\0';
+    return len;
 }
 
-// Recognize binary notation symbol
+// Write random identifier
 
-bool is_binsym(int c)
+size_t corpus_identifier(char *p)
 {
-    if (tolowercase(c) == 'b') {
-        return true;
-    }
-    return false;
+    const char *w;
+    size_t len;
+
+    w = corpus_words[corpus_random(CORPUS_WORDS)];
+    len = strlen(w);
+    memcpy(p,w,len);
+    return len;
 }
 
-// Recognize octal notation symbol
+// Write random integer literal that fits in a word
 
-bool is_octsym(int c)
+size_t corpus_number(char *p)
 {
-    if (tolowercase(c) == 'o') {
-        return true;
+    unsigned int value;
+    int bits;
+    int i;
+
+    value = corpus_random(WORD_MAX + 1) >> corpus_random(16);
+    switch (corpus_random(4)) {
+        case 0:
+            return sprintf(p,"%u",value);
+        case 1:
+            return sprintf(p,"0%xh",value);
+        case 2:
+            return sprintf(p,"%oo",value);
+        default:
+            for (bits=1; bits<16 && (value >> bits); bits++) {
+            }
+            for (i=0; i<bits; i++) {
+                p[i] = '0' + ((value >> (bits - 1 - i)) & 1);
+            }
+            p[bits] = 'b';
+            return bits + 1;
     }
-    return false;
 }
 
-// Recognize decimal notation symbol
+// Write random run of text
 
-bool is_decsym(int c)
+size_t corpus_text(char *p, bool quoted)
 {
-    if (tolowercase(c) == 'd') {
-        return true;
+    // Text for comments and strings: printable characters without quotation
+    // marks, mostly letters with some spaces. A semicolon ends a string, so
+    // strings leave it out.
+
+    static const char comment_chars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,;:!?-+*/()[]";
+    static const char string_chars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,:!?-+*/()[]";
+
+    size_t len;
+    size_t i;
+
+    if (quoted) {
+        len = corpus_random(40);
+        for (i=0; i<len; i++) {
+            p[i] = string_chars[corpus_random(sizeof(string_chars) - 1)];
+        }
     }
-    return false;
+    else {
+        len = corpus_random(72);
+        for (i=0; i<len; i++) {
+            p[i] = comment_chars[corpus_random(sizeof(comment_chars) - 1)];
+        }
+    }
+    return len;
 }
 
-// Recognize hexadecimal notation symbol
+// Write random line of given kind
 
-bool is_hexsym(int c)
+size_t corpus_line(int kind, char *p)
 {
-    if (tolowercase(c) == 'h') {
-        return true;
+    // Lines stay under 256 characters
+
+    static const char *mnemonics[] = { "add", "sub", "mov", "ld", "st", "xor", "shl", "jmp" };
+
+    char *q;
+    int n;
+    int i;
+
+    q = p;
+    if (kind == ck_mixed) {
+        kind = ck_count + corpus_random(5);
     }
-    return false;
+    switch (kind) {
+        case ck_identifiers:
+            n = 1 + corpus_random(8);
+            for (i=0; i<n; i++) {
+                q += corpus_identifier(q);
+                *q++ = i == 0 && corpus_random(4) == 0 ? ':' : ' ';
+            }
+            break;
+        case ck_numbers:
+            q += sprintf(q,"    dw");
+            n = 1 + corpus_random(8);
+            for (i=0; i<n; i++) {
+                *q++ = ' ';
+                q += corpus_number(q);
+            }
+            break;
+        case ck_comments:
+            *q++ = ';';
+            q += corpus_text(q,false);
+            break;
+        case ck_strings:
+            n = corpus_random(2) ? '"' : '\'';
+            q += sprintf(q,"    dw %c",n);
+            q += corpus_text(q,true);
+            *q++ = n;
+            break;
+        case ck_count:
+            // Label
+            q += corpus_identifier(q);
+            *q++ = ':';
+            break;
+        case ck_count + 1:
+            // Instruction on registers
+            q += sprintf(q,"    %s r%u r%u",mnemonics[corpus_random(8)],corpus_random(8),corpus_random(8));
+            break;
+        case ck_count + 2:
+            // Instruction with immediate, commented now and then
+            q += sprintf(q,"    ldi r%u ",corpus_random(8));
+            q += corpus_number(q);
+            if (corpus_random(2)) {
+                q += sprintf(q,"    ; ");
+                q += corpus_text(q,true);
+            }
+            break;
+        case ck_count + 3:
+            // Comment
+            q += sprintf(q,"; ");
+            q += corpus_text(q,true);
+            break;
+        default:
+            // Table of words
+            q += sprintf(q,"    dw ");
+            q += corpus_number(q);
+            *q++ = ' ';
+            q += corpus_number(q);
+            break;
+    }
+    *q++ = '\n';
+    return q - p;
 }
 
-// Recognize comment initiator
+// Generate corpus of given kind and size
 
-bool is_comment_initor(int c)
+char *generate_corpus(int kind, size_t size, size_t *len)
 {
-    if (c == ';') {
-        return true;
+    char *buf;
+    int i;
+
+    corpus_state = 0x9E3779B97F4A7C15ULL ^ kind;
+    for (i=0; i<CORPUS_WORDS; i++) {
+        corpus_word(corpus_words[i]);
     }
-    return false;
+    buf = emalloc(size + 256);
+    *len = 0;
+    while (*len < size) {
+        *len += corpus_line(kind,buf + *len);
+    }
+    return buf;
 }
 
-// Recognize underscore character
+// Write corpus to file
 
-bool is_underscore(int c)
+void write_corpus(const char *kind, const char *size, const char *filename)
 {
-    if (c == '_') {
-        return true;
+    FILE *fp;
+    char *buf;
+    size_t len;
+    int k;
+
+    k = find_corpus_kind(kind);
+    if (k < 0) {
+        fail("Unknown corpus kind %s",kind);
     }
-    return false;
+    buf = generate_corpus(k,parse_size(size),&len);
+    fp = filename ? efopen(filename,"wb") : stdout;
+    if (fwrite(buf,1,len,fp) != len) {
+        fail("Unable to write corpus");
+    }
+    if (filename) {
+        fclose(fp);
+    }
+    free(buf);
 }
 
-// Recognize single quotation mark
+// Benchmark lexer on every kind of corpus
 
-bool is_sqmark(int c)
+void bench_suite(const char *size)
 {
-    if (c == '\'') {
-        return true;
+    // Lex a generated corpus of each kind through get_next_token() and
+    // lex_batch() and report the best round. Allocations are counted in
+    // the last round. The token API releases its arena every few thousand
+    // tokens, the way a consumer done with them would, so memory stays
+    // bounded on large corpora.
+
+    enum { ROUNDS = 3, RELEASE = 4096 };
+
+    static const char *apis[] = { "token", "batch" };
+
+    struct lexer lexer;       // lexer for one round
+    struct token *token;      // current token
+    token_type type;          // type of current token
+    struct token_block block; // current token block
+    unsigned long count;      // tokens per round
+    char *buf;                // corpus
+    size_t len;               // length of corpus
+    double start;             // start time
+    double elapsed;           // time taken by round
+    double best;              // fastest round
+    uint64_t cycles;          // cycles taken by round
+    uint64_t fewest;          // cycles taken by fastest round
+    int k;                    // corpus kind
+    int a;                    // index into apis
+    int r;                    // round
+
+    printf("%-12s %-6s %9s %10s %12s %10s %13s %12s\n", "corpus", "api", "MB", "MB/s",
+           "Mtokens/s", "cycles/B", "arena/token", "heap/token");
+    for (k=0; k<ck_count; k++) {
+        buf = generate_corpus(k,parse_size(size),&len);
+        for (a=0; a<2; a++) {
+            best = 0;
+            fewest = 0;
+            count = 0;
+            for (r=0; r<ROUNDS; r++) {
+                open_lexer_buffer(&lexer,buf,len);
+                count = 0;
+                alloc_counts.heap = 0;
+                alloc_counts.arena = 0;
+                start = get_time();
+                cycles = get_cycles();
+                if (a == 0) {
+                    do {
+                        // Releasing the arena frees the token, so its type
+                        // is read first
+                        token = get_next_token(&lexer);
+                        type = token->type;
+                        if (++count % RELEASE == 0) {
+                            arena_release(&lexer.arena);
+                        }
+                    } while (type != t_eof);
+                }
+                else {
+                    do {
+                        count += lex_batch(&lexer,&block);
+                    } while (block.types[block.count-1] != t_eof);
+                }
+                cycles = get_cycles() - cycles;
+                elapsed = get_time() - start;
+                close_lexer(&lexer);
+                if (r == 0 || elapsed < best) {
+                    best = elapsed;
+                    fewest = cycles;
+                }
+            }
+            printf("%-12s %-6s %9.1f %10.1f %12.2f %10.2f %13.4f %12.6f\n", corpus_kinds[k], apis[a],
+                   len / 1e6, len / 1e6 / best, count / best / 1e6, (double)fewest / len,
+                   (double)alloc_counts.arena / count, (double)alloc_counts.heap / count);
+        }
+        free(buf);
     }
-    return false;
 }
 
-// Recognize double quotation mark
+// RECOGNIZER MICROBENCHMARKS
+
+// Recognizers and evaluator under test
+
+enum {
+    rk_id,
+    rk_bin,
+    rk_oct,
+    rk_dec,
+    rk_hex,
+    rk_sqstr,
+    rk_dqstr,
+    rk_eval,
+    rk_classify,
+    rk_cascade,
+    rk_count
+};
 
-bool is_dqmark(int c)
+const char *recognizer_names[rk_count] = {
+    [rk_id]    = "is_id",
+    [rk_bin]   = "is_bin",
+    [rk_oct]   = "is_oct",
+    [rk_dec]   = "is_dec",
+    [rk_hex]   = "is_hex",
+    [rk_sqstr] = "is_sqstr",
+    [rk_dqstr] = "is_dqstr",
+    [rk_eval]     = "eval",
+    [rk_classify] = "classify",
+    [rk_cascade]  = "cascade"
+};
+
+// Lexemes timed in one pass
+
+#define SAMPLE_COUNT 1024
+#define SAMPLE_SIZE 48
+
+char samples[SAMPLE_COUNT][SAMPLE_SIZE];
+size_t sample_lengths[SAMPLE_COUNT];
+
+// Write random lexeme for recognizer
+
+size_t sample_lexeme(int kind, bool accept, bool lng, char *p)
 {
-    if (c == '"') {
-        return true;
+    // Short lexemes have 1 to 4 characters between their first character
+    // and their suffix or closing mark, long ones 24 to 32. A rejected
+    // lexeme is an accepted one with one character spoiled. Lexemes for
+    // eval() are plain decimal digits. Lexemes for classifying are mostly
+    // identifiers, as in real sources: three in four are identifiers and
+    // the rest are integers and strings of every kind.
+
+    static const char *digits[] = {
+        [rk_bin] = "01",
+        [rk_oct] = "01234567",
+        [rk_dec] = "0123456789",
+        [rk_hex] = "0123456789abcdefABCDEF",
+        [rk_eval] = "0123456789"
+    };
+    static const char suffixes[] = {
+        [rk_bin] = 'b',
+        [rk_oct] = 'o',
+        [rk_dec] = 'd',
+        [rk_hex] = 'h'
+    };
+    static const char idchars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+    static const char text[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,;:!?";
+
+    const char *set; // characters of body
+    size_t setlen;   // number of characters in set
+    size_t n;        // length of body
+    size_t len;      // length of lexeme
+    size_t i;        // loop counter
+
+    if (kind == rk_classify || kind == rk_cascade) {
+        kind = corpus_random(4) ? rk_id : rk_bin + corpus_random(rk_dqstr - rk_bin + 1);
     }
-    return false;
+    n = lng ? 24 + corpus_random(9) : 1 + corpus_random(4);
+    len = 0;
+    switch (kind) {
+        case rk_id:
+            p[len++] = idchars[corpus_random(53)];
+            for (i=0; i<n; i++) {
+                p[len++] = idchars[corpus_random(sizeof(idchars) - 1)];
+            }
+            break;
+        case rk_sqstr:
+        case rk_dqstr:
+            p[len++] = kind == rk_sqstr ? '\'' : '"';
+            for (i=0; i<n; i++) {
+                p[len++] = text[corpus_random(sizeof(text) - 1)];
+            }
+            p[len++] = p[0];
+            break;
+        default:
+            set = digits[kind];
+            setlen = strlen(set);
+
+            // Start with a decimal digit so hexadecimals never look like
+            // identifiers
+            p[len++] = set[corpus_random(setlen < 10 ? setlen : 10)];
+            for (i=0; i<n; i++) {
+                p[len++] = set[corpus_random(setlen)];
+            }
+            if (kind != rk_eval && (kind != rk_dec || corpus_random(2))) {
+                p[len++] = suffixes[kind];
+            }
+            break;
+    }
+    if (!accept) {
+        if (kind == rk_sqstr || kind == rk_dqstr) {
+            p[len-1] = 'x';
+        }
+        else {
+            p[corpus_random(len)] = kind == rk_id ? '$' : 'z';
+        }
+    }
+    return len;
 }
 
-// Recognize a symbol
+// Time one pass of recognizer over samples
 
-bool is_symbol(int c)
+double time_recognizer(int kind)
 {
-    switch (c) {
-        case ':':
-        return true;
-        
-        default:
-        return false;
+    unsigned long sink; // keeps results alive
+    double start;       // start time
+    int value;          // value of integer lexeme
+    int i;              // loop counter
+
+    sink = 0;
+    start = get_time();
+    switch (kind) {
+        case rk_id:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_id(samples[i],sample_lengths[i]);
+            break;
+        case rk_bin:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_bin(samples[i],sample_lengths[i]);
+            break;
+        case rk_oct:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_oct(samples[i],sample_lengths[i]);
+            break;
+        case rk_dec:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_dec(samples[i],sample_lengths[i]);
+            break;
+        case rk_hex:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_hex(samples[i],sample_lengths[i]);
+            break;
+        case rk_sqstr:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_sqstr(samples[i],sample_lengths[i]);
+            break;
+        case rk_dqstr:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += is_dqstr(samples[i],sample_lengths[i]);
+            break;
+        case rk_eval:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += eval(samples[i],sample_lengths[i],10);
+            break;
+        case rk_classify:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += classify_lexeme(samples[i],sample_lengths[i],&value);
+            break;
+        case rk_cascade:
+            for (i=0; i<SAMPLE_COUNT; i++) sink += cascade_lexeme(samples[i],sample_lengths[i],&value);
+            break;
     }
+    start = get_time() - start;
+
+    // A result that can never be seen stops the compiler from dropping calls
+    if (sink == (unsigned long)-1) {
+        printf("(checksum %lu)\n", sink);
+    }
+    return start;
 }
 
-// Recognize whitespace
+// Classify lexeme by trying every recognizer in turn
 
-bool is_whitespace(int c)
+token_type cascade_lexeme(const char *s, size_t len, int *value)
 {
-    switch (c) {
-        case '\t': // horizontal tab
-        case '\v': // vertical tab
-        case '\r': // carriage return
-        case ' ':  // space
-        return true;
-        
-        default:
-        return false;
+    // The chain of recognizers the lexer used before classify_lexeme(),
+    // kept to measure the classifier against
+
+    if (is_terminal(":",s,len)) {
+        return t_colon;
+    }
+    if (is_bin(s,len)) {
+        *value = eval_bin(s,len);
+        return t_int;
+    }
+    if (is_oct(s,len)) {
+        *value = eval_oct(s,len);
+        return t_int;
+    }
+    if (is_dec(s,len)) {
+        *value = eval_dec(s,len);
+        return t_int;
+    }
+    if (is_hex(s,len)) {
+        *value = eval_hex(s,len);
+        return t_int;
+    }
+    if (is_id(s,len)) {
+        return t_id;
+    }
+    if (is_sqstr(s,len)) {
+        return t_squote;
+    }
+    if (is_dqstr(s,len)) {
+        return t_dquote;
     }
+    return t_unknown;
 }
 
-// HELPERS
-
-// Convert a lowercase to uppercase
+// Compare doubles for qsort()
 
-int touppercase(int c)
+int compare_doubles(const void *a, const void *b)
 {
-    if (c >= 'a' && c <= 'z') {
-        c -= 32;
-    }
-    return c;
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
 }
 
-// Convert an uppercase to lowercase
+// Benchmark recognizers
 
-int tolowercase(int c)
+void bench_recognizers()
 {
-    if (c >= 'A' && c <= 'Z') {
-        c += 32;
+    // Time every recognizer on accepted and rejected lexemes, short and
+    // long. Each measurement is one pass over SAMPLE_COUNT lexemes; after
+    // a warmup the passes are repeated and the median and 99th percentile
+    // per call are reported. eval() is timed on accepted decimal digits
+    // only, since it has nothing to reject. classify_lexeme() and the
+    // cascade of recognizers it replaced are timed on the same
+    // identifier-heavy lexemes, after checking that they agree on each.
+
+    enum { WARMUP = 50, REPS = 500 };
+
+    static double times[REPS];
+
+    bool accept;  // lexemes are accepted
+    bool lng;     // lexemes are long
+    int kind;     // recognizer
+    int seed;     // recognizer samples are drawn for
+    int x, y;     // values found by classifiers
+    int a, l;     // loop counters
+    int i, r;     // loop counters
+
+    printf("%-9s %-7s %-6s %12s %12s\n", "function", "input", "length", "median ns", "p99 ns");
+    for (kind=0; kind<rk_count; kind++) {
+        for (a=0; a<2; a++) {
+            accept = a == 0;
+            if (kind == rk_eval && !accept) {
+                continue;
+            }
+            for (l=0; l<2; l++) {
+                lng = l == 1;
+                seed = kind == rk_cascade ? rk_classify : kind;
+                corpus_state = 0x9E3779B97F4A7C15ULL ^ (seed * 4 + a * 2 + l);
+                for (i=0; i<SAMPLE_COUNT; i++) {
+                    sample_lengths[i] = sample_lexeme(kind,accept,lng,samples[i]);
+                    if (kind == rk_classify) {
+                        x = y = 0;
+                        if (classify_lexeme(samples[i],sample_lengths[i],&x) != cascade_lexeme(samples[i],sample_lengths[i],&y) || x != y) {
+                            fail("Classifier and recognizers disagree on %.*s",(int)sample_lengths[i],samples[i]);
+                        }
+                    }
+                }
+                for (r=0; r<WARMUP; r++) {
+                    time_recognizer(kind);
+                }
+                for (r=0; r<REPS; r++) {
+                    times[r] = time_recognizer(kind) * 1e9 / SAMPLE_COUNT;
+                }
+                qsort(times,REPS,sizeof(double),compare_doubles);
+                printf("%-9s %-7s %-6s %12.2f %12.2f\n", recognizer_names[kind], accept ? "accept" : "reject",
+                       lng ? "long" : "short", times[REPS/2], times[REPS*99/100]);
+            }
+        }
     }
-    return c;
 }
 
-// Get substring
+// Benchmark tree builder
 
-char *substr(const char *s, size_t len)
+void bench_tree(const char *filename)
 {
-    char *p;
-    if (len == 0) {
-        p = emalloc(1);
-        strcpy(p,"");
-    }
-    else {
-        p = emalloc(len+1);
-        memcpy(p,s,len);
-        p[len] = '\0'; // add string terminator
+    // Build the tree of a file repeatedly, then walk it from front to back,
+    // and report the best round of each along with what the tree cost in
+    // memory and heap allocations.
+
+    enum { ROUNDS = 5 };
+
+    struct lexer source;     // lexer holding the loaded source text
+    struct lexer lexer;      // lexer for one round
+    struct lookahead la;     // tokens seen by tree builder
+    struct tree tree;        // tree of one round
+    unsigned long allocs;    // heap allocations of one round
+    unsigned long sum;       // checksum of walk, so it is not optimized away
+    FILE *src;               // source file
+    double start;            // start time
+    double build;            // fastest build
+    double walk;             // fastest walk
+    double size;             // source size in megabytes
+    uint32_t i;              // index of node
+    int r;                   // round
+
+    src = efopen(filename,"rb");
+    init_lexer(&source);
+    load_source(&source,src);
+    fclose(src);
+    size = (source.end - source.buf) / 1e6;
+
+    build = 0;
+    walk = 0;
+    allocs = 0;
+    sum = 0;
+    for (r=0; r<ROUNDS; r++) {
+        open_lexer_buffer(&lexer,source.buf,source.end-source.buf);
+        init_lookahead(&la,&lexer);
+        init_tree(&tree);
+        allocs = alloc_counts.heap;
+        start = get_time();
+        build_tree(&tree,&la);
+        start = get_time() - start;
+        allocs = alloc_counts.heap - allocs;
+        if (r == 0 || start < build) {
+            build = start;
+        }
+
+        start = get_time();
+        for (i=1; i<tree.count; i++) {
+            sum += tree.nodes[i].kind + tree.nodes[i].value;
+        }
+        start = get_time() - start;
+        if (r == 0 || start < walk) {
+            walk = start;
+        }
+
+        if (r == ROUNDS - 1) {
+            printf("nodes         %12u\n", tree.count - 1);
+            printf("node bytes    %12zu\n", (size_t)tree.count * sizeof(struct node));
+            printf("heap allocs   %12lu (lexer and tree)\n", allocs);
+            printf("build MB/s    %12.1f\n", size / build);
+            printf("walk Mnodes/s %12.1f\n", tree.count / walk / 1e6);
+            printf("checksum      %12lu\n", sum);
+        }
+        release_tree(&tree);
+        close_lexer(&lexer);
     }
-    return p;
+
+    close_lexer(&source);
 }
 
-// Duplicate string
+// Benchmark symbol table
 
-char *dupstr(const char *s)
+void bench_symbols()
 {
-    char *p;
-    p = emalloc(strlen(s)+1);
-    strcpy(p,s);
-    return p;
-}
+    // Add labels l0, l1, ... to a symbol table of growing size, then look up
+    // random labels that are in it and random ones that are not, and report
+    // the cost per label, so the cost of the table can be watched as it
+    // outgrows each level of cache.
+
+    enum { LOOKUPS = 1 << 22 };
+
+    static const size_t counts[] = { 1000, 10000, 100000, 1000000, 10000000 };
+
+    struct symbol_table table; // table being measured
+    uint32_t *hashes;          // hashes of labels by ID, and of misses after
+    char name[32];             // text of label
+    size_t n;                  // number of labels
+    size_t c;                  // index into counts
+    size_t i;                  // loop counter
+    size_t k;                  // random label
+    unsigned long found;       // labels found, so lookups are not optimized away
+    double start;              // start time
+    double add;                // time to add labels
+    double hit;                // time to look up labels in table
+    double miss;               // time to look up labels not in table
+
+    printf("%-10s %10s %10s %10s %10s\n", "labels", "add ns", "hit ns", "miss ns", "MB");
+    for (c=0; c<sizeof(counts)/sizeof(counts[0]); c++) {
+        n = counts[c];
+        hashes = emalloc(2 * n * sizeof(uint32_t));
+        for (i=1; i<=2*n; i++) {
+            hashes[i-1] = hash_name(name,snprintf(name,sizeof(name),"l%zu",i));
+        }
 
-//=============================================================================
-// Error-trapped functions
-//=============================================================================
+        // IDs count from 1, as the identifier table hands them out
+        init_symbols(&table);
+        start = get_time();
+        for (i=1; i<=n; i++) {
+            add_symbol(&table,i,hashes[i-1])->value = i;
+        }
+        add = get_time() - start;
 
-// fopen()
+        found = 0;
+        start = get_time();
+        for (i=0; i<LOOKUPS; i++) {
+            k = corpus_random(n);
+            found += find_symbol(&table,k + 1,hashes[k]) != NULL;
+        }
+        hit = get_time() - start;
+        start = get_time();
+        for (i=0; i<LOOKUPS; i++) {
+            k = n + corpus_random(n);
+            found += find_symbol(&table,k + 1,hashes[k]) != NULL;
+        }
+        miss = get_time() - start;
+        if (found != LOOKUPS) {
+            fail("Symbol table lost labels");
+        }
 
-FILE *efopen(const char *filename, const char *mode)
+        printf("%-10zu %10.1f %10.1f %10.1f %10.2f\n", n, add / n * 1e9, hit / LOOKUPS * 1e9,
+            miss / LOOKUPS * 1e9, table.size * sizeof(struct symbol) / 1e6);
+        release_symbols(&table);
+        free(hashes);
+    }
+}
+
+// Check that streamed source text reports errors where loaded text does
+
+void check_positions(const char *filename)
 {
-    FILE *p;
-    p = fopen(filename,mode);
-    if (!p) {
-        fail("Something went wrong. Unable to open file %s", filename);
+    // Assemble the file loaded whole, then again streamed through windows
+    // of a few bytes, the way pipes are read, and compare the errors
+    // reported. Positions are what is at risk: a streaming lexer lets go
+    // of text as it reads on, and errors in a statement are reported after
+    // its last token.
+
+    static const size_t windows[] = { 1, 3, 64, 4096 };
+
+    struct lexer lexer; // lexer of one run
+    FILE *src;          // source file
+    char *expected;     // errors reported for loaded text
+    char *found;        // errors reported for streamed text
+    size_t i;           // index into windows
+    int wrong;          // number of runs reporting other errors
+
+    src = efopen(filename,"rb");
+    open_lexer(&lexer,src);
+    expected = capture_errors(&lexer);
+    close_lexer(&lexer);
+    fclose(src);
+
+    wrong = 0;
+    for (i=0; i<sizeof(windows)/sizeof(windows[0]); i++) {
+        src = efopen(filename,"rb");
+        open_stream_lexer(&lexer,fileno(src),windows[i]);
+        found = capture_errors(&lexer);
+        close_lexer(&lexer);
+        fclose(src);
+        printf("window %-6zu %s\n", windows[i], strcmp(expected,found) == 0 ? "same errors" : "different errors");
+        wrong += strcmp(expected,found) != 0;
+        free(found);
+    }
+    free(expected);
+    if (wrong) {
+        fail("Streamed source text reports errors elsewhere");
     }
-    return p;
 }
 
-// malloc()
+// Assemble source text and return the errors reported
 
-void *emalloc(size_t size)
+char *capture_errors(struct lexer *lx)
 {
-    void *p;
-    p = malloc(size);
-    if (!p) {
-        fail("Something went wrong. Unable to allocate memory");
+    // Errors go to standard output, so it is pointed at a temporary file
+    // while the assembler runs. The image is thrown away.
+
+    FILE *out;  // errors reported
+    int saved;  // descriptor of standard output
+    off_t len;  // length of errors
+    char *text; // errors, as a string
+
+    fflush(stdout);
+    out = tmpfile();
+    if (!out) {
+        fail("Unable to create temporary file");
     }
-    return p;
+    saved = dup(fileno(stdout));
+    dup2(fileno(out),fileno(stdout));
+    assemble(lx,1,"/dev/null");
+    fflush(stdout);
+    dup2(saved,fileno(stdout));
+    close(saved);
+
+    len = lseek(fileno(out),0,SEEK_END);
+    text = emalloc(len + 1);
+    rewind(out);
+    if (fread(text,1,len,out) != (size_t)len) {
+        fail("Unable to read temporary file");
+    }
+    text[len] = '\0';
+    fclose(out);
+    return text;
 }
+
+#endif